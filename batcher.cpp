@@ -0,0 +1,64 @@
+#include "batcher.hpp"
+#include "shared_state.hpp"
+
+batcher::
+    batcher(
+        net::io_context &ioc,
+        shared_state &state,
+        std::chrono::microseconds window)
+    : state_(state)
+    , window_(window)
+    , timer_(net::make_strand(ioc))
+{
+}
+
+bool batcher::
+    add(message_ptr const &msg)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto const now = clock::now();
+    auto const busy = now - last_ < window_;
+    last_ = now;
+    if (!batching_)
+    {
+        if (!busy)
+            return false;
+        batching_ = true;
+    }
+
+    pending_.push_back(msg);
+    if (!scheduled_)
+    {
+        scheduled_ = true;
+        net::post(
+            timer_.get_executor(),
+            [this]
+            {
+                timer_.expires_after(window_);
+                timer_.async_wait(
+                    [this](error_code ec)
+                    {
+                        if (!ec)
+                            flush();
+                    });
+            });
+    }
+    return true;
+}
+
+void batcher::
+    flush()
+{
+    std::vector<message_ptr> v;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        v.swap(pending_);
+        scheduled_ = false;
+
+        // The load went down, send the next message right away
+        if (v.size() <= 1)
+            batching_ = false;
+    }
+    if (!v.empty())
+        state_.deliver(v);
+}
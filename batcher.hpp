@@ -0,0 +1,54 @@
+#ifndef IR_WEBSOCKET_SERVER_BATCHER_HPP
+#define IR_WEBSOCKET_SERVER_BATCHER_HPP
+
+#include "message.hpp"
+#include "net.hpp"
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+// Forward declaration
+class shared_state;
+
+/** Accumulates the broadcasts of a shard while it is busy
+
+    When broadcasts arrive within the latency budget of each other,
+    they are held for up to the budget and then handed to every
+    recipient at once, costing each session a single post instead
+    of one per message. The session writes them through its stream
+    as usual, gathering them only when coalescing is enabled.
+
+    The batcher is adaptive: a broadcast arriving after a quiet
+    period is sent right away, and batching stops as soon as a
+    window collects no more than one message, so the latency of
+    an idle server is unchanged.
+*/
+class batcher
+{
+    using clock = std::chrono::steady_clock;
+
+    shared_state &state_;
+    clock::duration window_;
+    net::steady_timer timer_;
+
+    std::mutex mutex_;
+    std::vector<message_ptr> pending_;
+    clock::time_point last_;
+    bool batching_ = false;
+    bool scheduled_ = false;
+
+    void flush();
+
+public:
+    batcher(
+        net::io_context &ioc,
+        shared_state &state,
+        std::chrono::microseconds window);
+
+    // Returns false if the message should be sent right away,
+    // otherwise it is delivered with the batch. May be called
+    // from any thread.
+    bool add(message_ptr const &msg);
+};
+
+#endif
@@ -0,0 +1,161 @@
+#include "engine.hpp"
+#include "shared_state.hpp"
+
+engine::shard::
+    shard(net::io_context &ioc_)
+    : ioc(ioc_)
+{
+}
+
+engine::
+    engine(
+        std::vector<std::unique_ptr<net::io_context>> const &iocs,
+        std::string const &doc_root,
+        server_options const &options,
+        std::size_t ring_capacity)
+{
+    auto const n = iocs.size();
+    shards_.reserve(n);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        auto s = std::make_unique<shard>(*iocs[i]);
+        s->state = std::make_shared<shared_state>(doc_root, options);
+        s->state->start(*iocs[i]);
+        s->inbox.resize(n);
+        for (std::size_t j = 0; j < n; ++j)
+            if (j != i)
+                s->inbox[j] = std::make_unique<spsc_ring<message_ptr>>(ring_capacity);
+        s->overflow.resize(n);
+        s->waiting = std::make_unique<std::atomic<bool>[]>(n);
+        for (std::size_t j = 0; j < n; ++j)
+            s->waiting[j].store(false, std::memory_order_relaxed);
+        shards_.push_back(std::move(s));
+    }
+    for (std::size_t i = 0; i < n; ++i)
+        shards_[i]->state->attach(this, i);
+}
+
+engine::
+    ~engine()
+{
+    detach();
+}
+
+void engine::
+    detach()
+{
+    for (auto const &s : shards_)
+        s->state->attach(nullptr, 0);
+}
+
+void engine::
+    forward(std::size_t from, message_ptr const &msg)
+{
+    for (std::size_t to = 0; to < shards_.size(); ++to)
+    {
+        if (to == from)
+            continue;
+        if (push(from, to, msg))
+        {
+            notify(to);
+            continue;
+        }
+
+        // The ring is full, keep the message in order behind
+        // any earlier overflow. If the overflow was empty, nobody
+        // is going to flush it yet: ask the consumer to.
+        auto &q = shards_[from]->overflow[to];
+        q.push_back(msg);
+        if (q.size() == 1)
+            flush(from, to);
+    }
+}
+
+void engine::
+    send(std::size_t to, std::uint64_t connection_id, message_ptr msg)
+{
+    // Direct sends are rare, so a post is cheap enough and
+    // keeps them out of the broadcast rings
+    net::post(shards_[to]->ioc, [state = shards_[to]->state, connection_id, msg = std::move(msg)]()
+              { state->send(connection_id, msg); });
+}
+
+bool engine::
+    push(std::size_t from, std::size_t to, message_ptr const &msg)
+{
+    // Preserve ordering: nothing may overtake the overflow
+    if (!shards_[from]->overflow[to].empty())
+        return false;
+    return shards_[to]->inbox[from]->try_push(msg);
+}
+
+void engine::
+    flush(std::size_t from, std::size_t to)
+{
+    auto &s = *shards_[from];
+    auto &q = s.overflow[to];
+    auto &ring = *shards_[to]->inbox[from];
+
+    for (;;)
+    {
+        bool pushed = false;
+        while (!q.empty() && ring.try_push(q.front()))
+        {
+            q.pop_front();
+            pushed = true;
+        }
+        if (pushed)
+            notify(to);
+        if (q.empty())
+            return;
+
+        // Rather than spinning on a full ring, let the consumer
+        // post the next flush once it has popped. Try once more
+        // after raising the flag, in case the consumer made room
+        // before it could see it. The fences pair with the one
+        // in drain.
+        s.waiting[to].store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!ring.try_push(q.front()))
+            return;
+        q.pop_front();
+        notify(to);
+    }
+}
+
+void engine::
+    notify(std::size_t to)
+{
+    // Only post one drain at a time. The exchange pairs with
+    // the one in drain, so a message pushed after the consumer
+    // looked at its rings always results in another drain.
+    auto &s = *shards_[to];
+    if (!s.drain_pending.exchange(true, std::memory_order_acq_rel))
+        net::post(s.ioc, [this, to]()
+                  { drain(to); });
+}
+
+void engine::
+    drain(std::size_t to)
+{
+    auto &s = *shards_[to];
+    s.drain_pending.exchange(false, std::memory_order_acq_rel);
+
+    message_ptr msg;
+    for (std::size_t from = 0; from < s.inbox.size(); ++from)
+    {
+        auto const &ring = s.inbox[from];
+        if (!ring)
+            continue;
+        while (ring->try_pop(msg))
+            s.state->deliver(msg);
+
+        // Wake up a producer waiting for room in this ring
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto &waiting = shards_[from]->waiting[to];
+        if (waiting.load(std::memory_order_relaxed) &&
+            waiting.exchange(false, std::memory_order_relaxed))
+            net::post(shards_[from]->ioc, [this, from, to]()
+                      { flush(from, to); });
+    }
+}
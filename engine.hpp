@@ -0,0 +1,98 @@
+#ifndef IR_WEBSOCKET_SERVER_ENGINE_HPP
+#define IR_WEBSOCKET_SERVER_ENGINE_HPP
+
+#include "message.hpp"
+#include "net.hpp"
+#include "server_options.hpp"
+#include "spsc_ring.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Forward declaration
+class shared_state;
+
+/** A shared-nothing, thread-per-core server engine
+
+    Every core runs its own io_context with its own shared_state
+    shard, so sessions never touch another core's session map.
+    A broadcast is fanned out locally by the originating shard
+    and handed to every other shard as a single immutable message
+    pointer through a lock-free SPSC ring, one ring for each
+    ordered pair of shards. The receiving shard then fans the
+    message out to its own sessions.
+*/
+class engine
+{
+    struct shard
+    {
+        net::io_context &ioc;
+        std::shared_ptr<shared_state> state;
+
+        // inbox[j] carries messages from shard j to this shard
+        std::vector<std::unique_ptr<spsc_ring<message_ptr>>> inbox;
+
+        // Messages for shard j which did not fit in its ring,
+        // only touched by the thread running this shard
+        std::vector<std::deque<message_ptr>> overflow;
+
+        // waiting[j] is set while overflow[j] waits for shard j
+        // to make room in its ring, which it then signals by
+        // posting a flush to this shard
+        std::unique_ptr<std::atomic<bool>[]> waiting;
+
+        // Set while a drain of the inbox is posted
+        std::atomic<bool> drain_pending{false};
+
+        explicit shard(net::io_context &ioc_);
+    };
+
+    std::vector<std::unique_ptr<shard>> shards_;
+
+    bool push(std::size_t from, std::size_t to, message_ptr const &msg);
+    void flush(std::size_t from, std::size_t to);
+    void notify(std::size_t to);
+    void drain(std::size_t to);
+
+public:
+    // Shards are numbered in the top 8 bits of connection ids
+    static constexpr std::size_t max_shards = 256;
+
+    engine(
+        std::vector<std::unique_ptr<net::io_context>> const &iocs,
+        std::string const &doc_root,
+        server_options const &options,
+        std::size_t ring_capacity = 4096);
+
+    ~engine();
+
+    std::size_t
+    size() const noexcept
+    {
+        return shards_.size();
+    }
+
+    std::shared_ptr<shared_state> const &
+    state(std::size_t i) const noexcept
+    {
+        return shards_[i]->state;
+    }
+
+    // Hand a message to every shard except `from`. Must only
+    // be called on the thread running shard `from`.
+    void forward(std::size_t from, message_ptr const &msg);
+
+    // Send a message to one session of shard `to`, which
+    // looks it up and queues the message on its own thread
+    void send(std::size_t to, std::uint64_t connection_id, message_ptr msg);
+
+    // Disconnect the shards from the engine, so that sessions
+    // destroyed after the threads exit only broadcast locally.
+    void detach();
+};
+
+#endif
@@ -0,0 +1,420 @@
+#ifndef IR_WEBSOCKET_SERVER_GATED_SOCKET_HPP
+#define IR_WEBSOCKET_SERVER_GATED_SOCKET_HPP
+
+#include "beast.hpp"
+#include "net.hpp"
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/** The socket under a websocket stream, shared with raw writes
+
+    A session may put frames it serialized itself straight on the
+    socket, bypassing the stream. The stream does not know about
+    them, and may start writing a frame of its own at any time,
+    such as the pong answering a ping or the close answering a
+    close, which would then interleave with the raw bytes.
+
+    As the next layer of the stream, this socket sees every write
+    the stream makes. A raw write waits until the stream's current
+    frame is complete, and a write of the stream waits until the
+    raw write completes, so the two never overlap. Raw writes fail
+    with `net::error::operation_aborted` once the stream has torn
+    down the connection.
+
+    Every function must be called on the stream's strand, and at
+    most one raw write may be outstanding. The handler of a raw
+    write must keep the socket alive.
+*/
+class gated_socket
+{
+public:
+    using executor_type = session_socket::executor_type;
+
+private:
+    // A write waiting for the other side to finish. It is made
+    // with the allocator of its handler, like the operations of
+    // the socket, and frees itself before it starts the write.
+    struct pending
+    {
+        virtual void start(gated_socket &s) = 0;
+        virtual void destroy() noexcept = 0;
+
+    protected:
+        ~pending() = default;
+    };
+
+    struct pending_deleter
+    {
+        void
+        operator()(pending *p) const noexcept
+        {
+            p->destroy();
+        }
+    };
+
+    using pending_ptr = std::unique_ptr<pending, pending_deleter>;
+
+    template <bool Raw, class Buffers, class Handler>
+    struct pending_write;
+
+    template <bool Raw, class Buffers, class Handler>
+    static pending_ptr make_pending(Buffers const &buffers, Handler &&handler);
+
+    session_socket socket_;
+    bool stream_writing_ = false;
+    bool raw_writing_ = false;
+    bool torn_down_ = false;
+    pending_ptr stream_;
+    pending_ptr raw_;
+
+    template <class Buffers, class Handler>
+    void start_stream(Buffers const &buffers, Handler &&handler);
+
+    template <class Buffers, class Handler>
+    void start_raw(Buffers const &buffers, Handler &&handler);
+
+    void
+    resume(pending_ptr &p)
+    {
+        p.release()->start(*this);
+    }
+
+    template <class TeardownHandler>
+    friend void
+    async_teardown(
+        beast::role_type role,
+        gated_socket &s,
+        TeardownHandler &&handler);
+
+    friend void
+    teardown(
+        beast::role_type role,
+        gated_socket &s,
+        error_code &ec);
+
+public:
+    // The operations completing writes, public
+    // for the specializations of their associators
+    template <class Handler>
+    class stream_op;
+
+    template <class Handler>
+    class raw_op;
+
+    explicit gated_socket(session_socket socket)
+        : socket_(std::move(socket))
+    {
+    }
+
+    executor_type
+    get_executor() noexcept
+    {
+        return socket_.get_executor();
+    }
+
+    session_socket &
+    next_layer() noexcept
+    {
+        return socket_;
+    }
+
+    session_socket const &
+    next_layer() const noexcept
+    {
+        return socket_;
+    }
+
+    template <class MutableBufferSequence, class ReadHandler>
+    auto
+    async_read_some(MutableBufferSequence const &buffers, ReadHandler &&handler)
+    {
+        return socket_.async_read_some(
+            buffers, std::forward<ReadHandler>(handler));
+    }
+
+    // Called by the stream, may be one of several for one frame
+    template <class ConstBufferSequence, class WriteHandler>
+    void
+    async_write_some(ConstBufferSequence const &buffers, WriteHandler &&handler)
+    {
+        if (raw_writing_)
+        {
+            stream_ = make_pending<false>(
+                buffers, std::forward<WriteHandler>(handler));
+            return;
+        }
+        start_stream(buffers, std::forward<WriteHandler>(handler));
+    }
+
+    // Write all of the buffers between two frames of the stream
+    template <class ConstBufferSequence, class WriteHandler>
+    void
+    async_write_raw(ConstBufferSequence const &buffers, WriteHandler &&handler)
+    {
+        if (stream_writing_)
+        {
+            raw_ = make_pending<true>(
+                buffers, std::forward<WriteHandler>(handler));
+            return;
+        }
+        start_raw(buffers, std::forward<WriteHandler>(handler));
+    }
+};
+
+// Completes a write of the stream, then lets a raw write go
+template <class Handler>
+class gated_socket::stream_op
+{
+    gated_socket *s_;
+    Handler handler_;
+
+public:
+    stream_op(gated_socket &s, Handler handler)
+        : s_(&s)
+        , handler_(std::move(handler))
+    {
+    }
+
+    Handler const &
+    handler() const noexcept
+    {
+        return handler_;
+    }
+
+    void
+    operator()(error_code ec, std::size_t bytes)
+    {
+        auto const s = s_;
+        s->stream_writing_ = false;
+        if (!s->raw_)
+            return handler_(ec, bytes);
+
+        // The rest of a frame is written from within the handler,
+        // so a raw write waits until the handler writes no more.
+        // The pending raw write keeps the socket alive.
+        handler_(ec, bytes);
+        if (!s->stream_writing_ && s->raw_)
+            s->resume(s->raw_);
+    }
+
+    friend bool
+    asio_handler_is_continuation(stream_op *op)
+    {
+        using net::asio_handler_is_continuation;
+        return asio_handler_is_continuation(std::addressof(op->handler_));
+    }
+};
+
+// Completes a raw write, then lets the stream go
+template <class Handler>
+class gated_socket::raw_op
+{
+    gated_socket *s_;
+    Handler handler_;
+
+public:
+    raw_op(gated_socket &s, Handler handler)
+        : s_(&s)
+        , handler_(std::move(handler))
+    {
+    }
+
+    Handler const &
+    handler() const noexcept
+    {
+        return handler_;
+    }
+
+    void
+    operator()(error_code ec, std::size_t bytes)
+    {
+        s_->raw_writing_ = false;
+        if (s_->stream_)
+            s_->resume(s_->stream_);
+        handler_(ec, bytes);
+    }
+};
+
+template <bool Raw, class Buffers, class Handler>
+struct gated_socket::pending_write final : pending
+{
+    using allocator_type = typename std::allocator_traits<
+        net::associated_allocator_t<Handler>>::template rebind_alloc<pending_write>;
+
+    Buffers buffers;
+    Handler handler;
+
+    template <class DeducedHandler>
+    pending_write(Buffers const &b, DeducedHandler &&h)
+        : buffers(b)
+        , handler(std::forward<DeducedHandler>(h))
+    {
+    }
+
+    void
+    start(gated_socket &s) override
+    {
+        allocator_type alloc(net::get_associated_allocator(handler));
+        auto b = std::move(buffers);
+        auto h = std::move(handler);
+        free(alloc);
+        if (!Raw)
+            return s.start_stream(b, std::move(h));
+
+        // Nothing may follow the stream's close frame
+        if (s.torn_down_)
+            return h(net::error::operation_aborted, 0);
+        s.start_raw(b, std::move(h));
+    }
+
+    void
+    destroy() noexcept override
+    {
+        free(allocator_type(net::get_associated_allocator(handler)));
+    }
+
+    void
+    free(allocator_type alloc) noexcept
+    {
+        this->~pending_write();
+        std::allocator_traits<allocator_type>::deallocate(alloc, this, 1);
+    }
+};
+
+template <bool Raw, class Buffers, class Handler>
+auto gated_socket::
+    make_pending(Buffers const &buffers, Handler &&handler)
+    -> pending_ptr
+{
+    using op = pending_write<Raw, Buffers, typename std::decay<Handler>::type>;
+    typename op::allocator_type alloc(net::get_associated_allocator(handler));
+    auto const p = std::allocator_traits<
+        typename op::allocator_type>::allocate(alloc, 1);
+    try
+    {
+        return pending_ptr(new (p) op(buffers, std::forward<Handler>(handler)));
+    }
+    catch (...)
+    {
+        std::allocator_traits<
+            typename op::allocator_type>::deallocate(alloc, p, 1);
+        throw;
+    }
+}
+
+template <class Buffers, class Handler>
+void gated_socket::
+    start_stream(Buffers const &buffers, Handler &&handler)
+{
+    using handler_type = typename std::decay<Handler>::type;
+    stream_writing_ = true;
+    socket_.async_write_some(
+        buffers,
+        stream_op<handler_type>(*this, std::forward<Handler>(handler)));
+}
+
+template <class Buffers, class Handler>
+void gated_socket::
+    start_raw(Buffers const &buffers, Handler &&handler)
+{
+    using handler_type = typename std::decay<Handler>::type;
+    if (torn_down_)
+        return net::post(
+            socket_.get_executor(),
+            beast::bind_front_handler(
+                std::forward<Handler>(handler),
+                net::error::operation_aborted,
+                std::size_t(0)));
+    raw_writing_ = true;
+    net::async_write(
+        socket_,
+        buffers,
+        raw_op<handler_type>(*this, std::forward<Handler>(handler)));
+}
+
+template <class TeardownHandler>
+void
+async_teardown(
+    beast::role_type role,
+    gated_socket &s,
+    TeardownHandler &&handler)
+{
+    s.torn_down_ = true;
+    websocket::async_teardown(
+        role, s.socket_, std::forward<TeardownHandler>(handler));
+}
+
+inline void
+teardown(
+    beast::role_type role,
+    gated_socket &s,
+    error_code &ec)
+{
+    s.torn_down_ = true;
+    websocket::teardown(role, s.socket_, ec);
+}
+
+// The wrapped handlers run on the executor and allocate
+// from the allocator of the handlers they complete
+namespace boost {
+namespace asio {
+
+template <class Handler, class Executor>
+struct associated_executor<gated_socket::stream_op<Handler>, Executor>
+{
+    using type = associated_executor_t<Handler, Executor>;
+
+    static type
+    get(gated_socket::stream_op<Handler> const &op,
+        Executor const &ex = Executor()) noexcept
+    {
+        return net::get_associated_executor(op.handler(), ex);
+    }
+};
+
+template <class Handler, class Allocator>
+struct associated_allocator<gated_socket::stream_op<Handler>, Allocator>
+{
+    using type = associated_allocator_t<Handler, Allocator>;
+
+    static type
+    get(gated_socket::stream_op<Handler> const &op,
+        Allocator const &a = Allocator()) noexcept
+    {
+        return net::get_associated_allocator(op.handler(), a);
+    }
+};
+
+template <class Handler, class Executor>
+struct associated_executor<gated_socket::raw_op<Handler>, Executor>
+{
+    using type = associated_executor_t<Handler, Executor>;
+
+    static type
+    get(gated_socket::raw_op<Handler> const &op,
+        Executor const &ex = Executor()) noexcept
+    {
+        return net::get_associated_executor(op.handler(), ex);
+    }
+};
+
+template <class Handler, class Allocator>
+struct associated_allocator<gated_socket::raw_op<Handler>, Allocator>
+{
+    using type = associated_allocator_t<Handler, Allocator>;
+
+    static type
+    get(gated_socket::raw_op<Handler> const &op,
+        Allocator const &a = Allocator()) noexcept
+    {
+        return net::get_associated_allocator(op.handler(), a);
+    }
+};
+
+} // namespace asio
+} // namespace boost
+
+#endif
@@ -0,0 +1,83 @@
+#include "handler_memory.hpp"
+#include <new>
+
+handler_memory::
+    ~handler_memory()
+{
+    for (auto &c : free_)
+        for (auto &slot : c)
+            if (auto p = slot.load(std::memory_order_relaxed))
+                ::operator delete(p);
+}
+
+handler_memory::pointer
+handler_memory::
+    create()
+{
+    return pointer(new handler_memory);
+}
+
+// Returns the class of a size, or `classes` if it is not recycled
+std::size_t
+handler_memory::
+    size_class(std::size_t size) noexcept
+{
+    std::size_t c = 0;
+    while (c < classes && (min_size << c) < size)
+        ++c;
+    return c;
+}
+
+void handler_memory::
+    unref() noexcept
+{
+    if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete this;
+}
+
+void *
+handler_memory::
+    allocate(std::size_t size)
+{
+    auto const c = size_class(size);
+    if (c == classes)
+        return ::operator new(size);
+
+    refs_.fetch_add(1, std::memory_order_relaxed);
+    for (auto &slot : free_[c])
+        if (auto p = slot.exchange(nullptr, std::memory_order_acquire))
+            return p;
+    try
+    {
+        return ::operator new(min_size << c);
+    }
+    catch (...)
+    {
+        unref();
+        throw;
+    }
+}
+
+void handler_memory::
+    deallocate(void *p, std::size_t size) noexcept
+{
+    auto const c = size_class(size);
+    if (c == classes)
+        return ::operator delete(p);
+
+    // Keep the block for the next operation if a slot is free
+    for (auto &slot : free_[c])
+    {
+        void *expected = nullptr;
+        if (slot.compare_exchange_strong(
+                expected, p, std::memory_order_release,
+                std::memory_order_relaxed))
+        {
+            p = nullptr;
+            break;
+        }
+    }
+    if (p)
+        ::operator delete(p);
+    unref();
+}
@@ -0,0 +1,164 @@
+#ifndef IR_WEBSOCKET_SERVER_HANDLER_MEMORY_HPP
+#define IR_WEBSOCKET_SERVER_HANDLER_MEMORY_HPP
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+/** Recycles the memory of the asynchronous operations of one owner
+
+    Asio allocates the state of every asynchronous operation,
+    and Beast the state of its composed operations, through the
+    allocator associated with the completion handler. A session
+    bound to this memory gets each block back when its operation
+    completes and hands it to the next operation of a similar
+    size, so a session in its steady state reads and writes
+    without calling malloc. This holds as long as the socket names
+    its strand in its type, see session_socket: completions which
+    go through a type-erased executor are allocated by Asio.
+
+    Blocks are grouped in power of two size classes, with a few
+    slots for each class. Any thread may allocate or give back a
+    block, since operations complete on the threads running the
+    io_context rather than on the session's strand. Blocks which
+    are too large, or which find their slots full, go back to the
+    heap.
+
+    Blocks still held by pending operations keep the memory
+    alive, so an operation destroyed after its owner (when the
+    io_context shuts down) can still give its block back.
+*/
+class handler_memory
+{
+    // Recycled sizes are 64, 128, ... up to 4096 bytes
+    static constexpr std::size_t min_size = 64;
+    static constexpr std::size_t classes = 7;
+    static constexpr std::size_t slots = 4;
+
+    std::array<std::array<std::atomic<void *>, slots>, classes> free_{};
+
+    // One for the owner plus one for each block given out
+    std::atomic<std::size_t> refs_{1};
+
+    handler_memory() = default;
+    ~handler_memory();
+
+    static std::size_t size_class(std::size_t size) noexcept;
+    void unref() noexcept;
+
+public:
+    struct release
+    {
+        void
+        operator()(handler_memory *m) const noexcept
+        {
+            m->unref();
+        }
+    };
+
+    using pointer = std::unique_ptr<handler_memory, release>;
+
+    static pointer create();
+
+    void *allocate(std::size_t size);
+    void deallocate(void *p, std::size_t size) noexcept;
+};
+
+/** An allocator taking its memory from a handler_memory
+*/
+template <class T>
+class handler_allocator
+{
+    template <class>
+    friend class handler_allocator;
+
+    handler_memory *memory_;
+
+public:
+    using value_type = T;
+
+    explicit handler_allocator(handler_memory &memory) noexcept
+        : memory_(&memory)
+    {
+    }
+
+    template <class U>
+    handler_allocator(handler_allocator<U> const &other) noexcept
+        : memory_(other.memory_)
+    {
+    }
+
+    T *
+    allocate(std::size_t n)
+    {
+        return static_cast<T *>(memory_->allocate(sizeof(T) * n));
+    }
+
+    void
+    deallocate(T *p, std::size_t n) noexcept
+    {
+        memory_->deallocate(p, sizeof(T) * n);
+    }
+
+    template <class U>
+    friend bool
+    operator==(
+        handler_allocator const &a,
+        handler_allocator<U> const &b) noexcept
+    {
+        return a.memory_ == b.memory_;
+    }
+
+    template <class U>
+    friend bool
+    operator!=(
+        handler_allocator const &a,
+        handler_allocator<U> const &b) noexcept
+    {
+        return a.memory_ != b.memory_;
+    }
+};
+
+/** A completion handler whose associated allocator uses a handler_memory
+*/
+template <class Handler>
+class memory_bound_handler
+{
+    handler_memory *memory_;
+    Handler handler_;
+
+public:
+    using allocator_type = handler_allocator<void>;
+
+    memory_bound_handler(handler_memory &memory, Handler handler)
+        : memory_(&memory)
+        , handler_(std::move(handler))
+    {
+    }
+
+    allocator_type
+    get_allocator() const noexcept
+    {
+        return allocator_type(*memory_);
+    }
+
+    template <class... Args>
+    void
+    operator()(Args &&...args)
+    {
+        handler_(std::forward<Args>(args)...);
+    }
+};
+
+// Returns the handler with its operations allocated from `memory`
+template <class Handler>
+memory_bound_handler<typename std::decay<Handler>::type>
+bind_memory(handler_memory &memory, Handler &&handler)
+{
+    return {memory, std::forward<Handler>(handler)};
+}
+
+#endif
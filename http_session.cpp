@@ -9,7 +9,9 @@
 
 #include "http_session.hpp"
 #include "websocket_session.hpp"
+#include <cstdint>
 #include <iostream>
+#include <random>
 
 //------------------------------------------------------------------------------
 
@@ -97,6 +99,37 @@ path_cat(
     return result;
 }
 
+// Serialize the server counters for the /api/stats endpoint
+std::string
+stats_to_json(server_stats const &stats)
+{
+    json::object obj;
+    obj["dropped_oldest"] = stats.dropped_oldest.load();
+    obj["dropped_newest"] = stats.dropped_newest.load();
+    obj["dropped_on_disconnect"] = stats.dropped_on_disconnect.load();
+    obj["slow_consumer_disconnects"] = stats.slow_consumer_disconnects.load();
+    obj["streams_aborted"] = stats.streams_aborted.load();
+    obj["rate_limited_delayed"] = stats.rate_limited_delayed.load();
+    obj["rate_limited_dropped"] = stats.rate_limited_dropped.load();
+    obj["bus_dropped"] = stats.bus_dropped.load();
+    obj["shm_dropped"] = stats.shm_dropped.load();
+    return json::serialize(obj);
+}
+
+// Returns a fresh subject for a token issued by /api/ws. The
+// server knows nothing about its clients, so every token gets
+// its own: the subject limits then apply to all the connections
+// made with one token. An external issuer setting `sub` to a
+// user id limits all of that user's tokens together instead.
+std::string
+new_subject()
+{
+    thread_local std::mt19937_64 gen{
+        (static_cast<std::uint64_t>(std::random_device{}()) << 32) ^
+        std::random_device{}()};
+    return "anon-" + format_connection_id(gen());
+}
+
 // This function produces an HTTP response for the given
 // request. The type of the response object depends on the
 // contents of the request, so the interface requires the
@@ -105,7 +138,7 @@ template <
     class Body, class Allocator,
     class Send>
 void handle_request(
-    boost::beast::string_view doc_root,
+    shared_state const &state,
     http::request<Body, http::basic_fields<Allocator>> &&req,
     Send &&send)
 {
@@ -125,6 +158,7 @@ void handle_request(
         const auto token = jwt::create<jwt::traits::boost_json>()
             .set_issuer("auth0")
             .set_audience("aud0")
+            .set_subject(json::string_view(new_subject()))
             .set_issued_at(std::chrono::system_clock::now())
             .set_expires_at(std::chrono::system_clock::now() + std::chrono::seconds{3600})
             .sign(jwt::algorithm::hs256{"secret"});
@@ -138,6 +172,18 @@ void handle_request(
         return send(std::move(res));
     }
 
+    if (req.target() == "/api/stats" &&
+        req.method() == http::verb::get)
+    {
+        http::response<http::string_body> res{http::status::ok, req.version()};
+        res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+        res.set(http::field::content_type, "application/json");
+        res.keep_alive(req.keep_alive());
+        res.body() = stats_to_json(state.stats());
+        res.prepare_payload();
+        return send(std::move(res));
+    }
+
     // Returns a bad request response
     auto const bad_request =
         [&req](boost::beast::string_view why)
@@ -189,7 +235,7 @@ void handle_request(
         return send(bad_request("Illegal request-target"));
 
     // Build the path to the requested file
-    std::string path = path_cat(doc_root, req.target());
+    std::string path = path_cat(state.doc_root(), req.target());
     if (req.target().back() == '/')
         path.append("index.html");
 
@@ -236,10 +282,20 @@ void handle_request(
 
 http_session::
     http_session(
-        tcp::socket socket,
+        session_socket socket,
         std::shared_ptr<shared_state> const &state)
-    : socket_(std::move(socket)), state_(state)
+    : socket_(std::move(socket))
+    , buffer_(session_pool::local().take_buffer())
+    , state_(state)
+{
+}
+
+http_session::
+    ~http_session()
 {
+    // Leave the grown buffer to the next session
+    session_pool::local().give_back(
+        std::move(buffer_), state_->options().pool_memory);
 }
 
 void http_session::
@@ -247,10 +303,12 @@ void http_session::
 {
     // Read a request
     http::async_read(socket_, buffer_, req_,
-                     [self = shared_from_this()](error_code ec, std::size_t bytes)
-                     {
-                         self->on_read(ec, bytes);
-                     });
+                     bind_memory(
+                         *memory_,
+                         [self = shared_from_this()](error_code ec, std::size_t bytes)
+                         {
+                             self->on_read(ec, bytes);
+                         }));
 }
 
 // Report a failure
@@ -282,14 +340,16 @@ void http_session::
     if (websocket::is_upgrade(req_))
     {
         // Create a WebSocket session by transferring the socket
-        std::make_shared<websocket_session>(
+        std::allocate_shared<websocket_session>(
+            session_allocator<websocket_session>(
+                state_->options().pool_memory),
             std::move(socket_), state_)
             ->run(std::move(req_));
         return;
     }
 
     // Send the response
-    handle_request(state_->doc_root(), std::move(req_),
+    handle_request(*state_, std::move(req_),
                    [this](auto &&response)
                    {
                        // The lifetime of the message has to extend
@@ -311,11 +371,13 @@ void http_session::
                        // Write the response
                        auto self = shared_from_this();
                        http::async_write(this->socket_, *sp,
-                                         [self, sp](
-                                             error_code ec, std::size_t bytes)
-                                         {
-                                             self->on_write(ec, bytes, sp->need_eof());
-                                         });
+                                         bind_memory(
+                                             *memory_,
+                                             [self, sp](
+                                                 error_code ec, std::size_t bytes)
+                                             {
+                                                 self->on_write(ec, bytes, sp->need_eof());
+                                             }));
 #endif
                    });
 }
@@ -341,8 +403,10 @@ void http_session::
 
     // Read another request
     http::async_read(socket_, buffer_, req_,
-                     [self = shared_from_this()](error_code ec, std::size_t bytes)
-                     {
-                         self->on_read(ec, bytes);
-                     });
+                     bind_memory(
+                         *memory_,
+                         [self = shared_from_this()](error_code ec, std::size_t bytes)
+                         {
+                             self->on_read(ec, bytes);
+                         }));
 }
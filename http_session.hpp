@@ -12,6 +12,8 @@
 
 #include "net.hpp"
 #include "beast.hpp"
+#include "handler_memory.hpp"
+#include "session_pool.hpp"
 #include "json.hpp"
 #include "include/jwt-cpp/traits/boost-json/defaults.h"
 #include "shared_state.hpp"
@@ -22,7 +24,9 @@
 */
 class http_session : public std::enable_shared_from_this<http_session>
 {
-    tcp::socket socket_;
+    // Recycled by every asynchronous operation of the session
+    handler_memory::pointer memory_ = handler_memory::create();
+    session_socket socket_;
     beast::flat_buffer buffer_;
     std::shared_ptr<shared_state> state_;
     http::request<http::string_body> req_;
@@ -34,9 +38,11 @@ class http_session : public std::enable_shared_from_this<http_session>
 
 public:
     http_session(
-        tcp::socket socket,
+        session_socket socket,
         std::shared_ptr<shared_state> const& state);
 
+    ~http_session();
+
     void run();
 };
 
@@ -9,15 +9,24 @@
 
 #include "listener.hpp"
 #include "http_session.hpp"
+#include "session_pool.hpp"
 #include <iostream>
 
+#ifdef SO_REUSEPORT
+// Lets several acceptors bind the same endpoint; the
+// kernel then load-balances new connections across them.
+using reuse_port_option =
+    net::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+
 listener::
 listener(
     net::io_context& ioc,
     tcp::endpoint endpoint,
-    std::shared_ptr<shared_state> const& state)
-    : acceptor_(ioc)
-    , socket_(ioc)
+    std::shared_ptr<shared_state> const& state,
+    bool reuse_port)
+    : ioc_(ioc)
+    , acceptor_(ioc)
     , state_(state)
 {
     error_code ec;
@@ -38,6 +47,21 @@ listener(
         return;
     }
 
+    // Allow one acceptor per thread on the same port
+    if(reuse_port)
+    {
+#ifdef SO_REUSEPORT
+        acceptor_.set_option(reuse_port_option(true), ec);
+#else
+        ec = net::error::operation_not_supported;
+#endif
+        if(ec)
+        {
+            fail(ec, "reuse_port");
+            return;
+        }
+    }
+
     // Bind to the server address
     acceptor_.bind(endpoint, ec);
     if(ec)
@@ -61,12 +85,24 @@ listener::
 run()
 {
     // Start accepting a connection
+    do_accept();
+}
+
+void
+listener::
+do_accept()
+{
+    // The new connection gets its own strand, so that
+    // each session's handlers never run concurrently
+    // even when several threads call io_context::run.
     acceptor_.async_accept(
-        socket_,
-        [self = shared_from_this()](error_code ec)
-        {
-            self->on_accept(ec);
-        });
+        net::make_strand(ioc_),
+        bind_memory(
+            *memory_,
+            [self = shared_from_this()](error_code ec, session_socket socket)
+            {
+                self->on_accept(ec, std::move(socket));
+            }));
 }
 
 // Report a failure
@@ -83,21 +119,18 @@ fail(error_code ec, char const* what)
 // Handle a connection
 void
 listener::
-on_accept(error_code ec)
+on_accept(error_code ec, session_socket socket)
 {
     if(ec)
         return fail(ec, "accept");
     else
         // Launch a new session for this connection
-        std::make_shared<http_session>(
-            std::move(socket_),
+        std::allocate_shared<http_session>(
+            session_allocator<http_session>(
+                state_->options().pool_memory),
+            std::move(socket),
             state_)->run();
 
     // Accept another connection
-    acceptor_.async_accept(
-        socket_,
-        [self = shared_from_this()](error_code ec)
-        {
-            self->on_accept(ec);
-        });
+    do_accept();
 }
@@ -10,6 +10,7 @@
 #ifndef IR_WEBSOCKET_SERVER_LISTENER_HPP
 #define IR_WEBSOCKET_SERVER_LISTENER_HPP
 
+#include "handler_memory.hpp"
 #include "net.hpp"
 #include <memory>
 #include <string>
@@ -20,21 +21,31 @@ class shared_state;
 // Accepts incoming connections and launches the sessions
 class listener : public std::enable_shared_from_this<listener>
 {
+    net::io_context& ioc_;
+    handler_memory::pointer memory_ = handler_memory::create();
     tcp::acceptor acceptor_;
-    tcp::socket socket_;
     std::shared_ptr<shared_state> state_;
 
     void fail(error_code ec, char const* what);
-    void on_accept(error_code ec);
+    void do_accept();
+    void on_accept(error_code ec, session_socket socket);
 
 public:
     listener(
         net::io_context& ioc,
         tcp::endpoint endpoint,
-        std::shared_ptr<shared_state> const& state);
+        std::shared_ptr<shared_state> const& state,
+        bool reuse_port = false);
 
     // Start accepting incoming connections
     void run();
+
+    // The address accepted on, with the port chosen for port zero
+    tcp::endpoint
+    local_endpoint() const
+    {
+        return acceptor_.local_endpoint();
+    }
 };
 
 #endif
@@ -0,0 +1,267 @@
+#include "local_bus.hpp"
+#include "shared_state.hpp"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+
+local_bus::peer::
+    peer(net::strand<net::io_context::executor_type> const &ex, std::string path_)
+    : path(std::move(path_))
+    , socket(ex)
+    , timer(ex)
+{
+}
+
+local_bus::inbound::
+    inbound(protocol::socket socket_)
+    : socket(std::move(socket_))
+{
+}
+
+local_bus::
+    local_bus(
+        net::io_context &ioc,
+        std::shared_ptr<shared_state> const &state,
+        std::string path,
+        std::vector<std::string> const &peers)
+    : strand_(net::make_strand(ioc))
+    , acceptor_(strand_)
+    , state_(state)
+    , path_(std::move(path))
+{
+    for (auto const &p : peers)
+        peers_.push_back(std::make_unique<peer>(strand_, p));
+
+    // Remove the socket left behind by an earlier run
+    std::remove(path_.c_str());
+
+    error_code ec;
+    protocol::endpoint const endpoint(path_);
+    acceptor_.open(endpoint.protocol(), ec);
+    if (ec)
+    {
+        fail(ec, "bus open");
+        return;
+    }
+    acceptor_.bind(endpoint, ec);
+    if (ec)
+    {
+        fail(ec, "bus bind");
+        return;
+    }
+    acceptor_.listen(net::socket_base::max_listen_connections, ec);
+    if (ec)
+    {
+        fail(ec, "bus listen");
+        return;
+    }
+}
+
+local_bus::
+    ~local_bus()
+{
+    if (acceptor_.is_open())
+        std::remove(path_.c_str());
+}
+
+void local_bus::
+    fail(error_code ec, char const *what)
+{
+    if (ec == net::error::operation_aborted)
+        return;
+    std::cerr << what << ": " << ec.message() << "\n";
+}
+
+void local_bus::
+    run()
+{
+    net::dispatch(
+        strand_,
+        [self = shared_from_this()]
+        {
+            if (self->acceptor_.is_open())
+                self->do_accept();
+            for (auto const &p : self->peers_)
+                self->do_connect(*p);
+        });
+}
+
+void local_bus::
+    do_accept()
+{
+    acceptor_.async_accept(
+        [self = shared_from_this()](
+            error_code ec, protocol::socket socket)
+        {
+            if (ec)
+                return self->fail(ec, "bus accept");
+            self->do_read(std::make_shared<inbound>(std::move(socket)));
+            self->do_accept();
+        });
+}
+
+void local_bus::
+    do_read(std::shared_ptr<inbound> in)
+{
+    auto &socket = in->socket;
+    auto const buffers = in->buffer.prepare(65536);
+    socket.async_read_some(
+        buffers,
+        [self = shared_from_this(), in = std::move(in)](
+            error_code ec, std::size_t bytes)
+        {
+            // The sibling went away, it reconnects when it restarts
+            if (ec)
+                return;
+            in->buffer.commit(bytes);
+            if (!self->on_frames(in->buffer))
+                return self->fail(net::error::invalid_argument, "bus frame");
+            self->do_read(std::move(in));
+        });
+}
+
+// Deliver every complete frame in the buffer, returns
+// false if the sibling sent something which is not a frame
+bool local_bus::
+    on_frames(beast::flat_buffer &buffer)
+{
+    for (;;)
+    {
+        auto const data = buffer.data();
+        auto const p = static_cast<unsigned char const *>(data.data());
+        if (data.size() < 4)
+            return true;
+        std::size_t const size =
+            (std::size_t(p[0]) << 24) | (std::size_t(p[1]) << 16) |
+            (std::size_t(p[2]) << 8) | std::size_t(p[3]);
+        if (data.size() < 4 + size)
+            return true;
+        if (size < 3)
+            return false;
+        bool const binary = (p[4] & 1) != 0;
+        bool const high = (p[4] & 2) != 0;
+        std::size_t const topic_size = (std::size_t(p[5]) << 8) | p[6];
+        if (topic_size > size - 3)
+            return false;
+        auto const topic = reinterpret_cast<char const *>(p + 7);
+        auto const body = topic + topic_size;
+        auto msg = make_message(
+            std::string(body, size - 3 - topic_size),
+            std::string(topic, topic_size),
+            binary);
+        if (high)
+            msg->set_priority(message_priority::high);
+        state_->receive(std::move(msg));
+        buffer.consume(4 + size);
+    }
+}
+
+void local_bus::
+    do_connect(peer &p)
+{
+    p.socket.async_connect(
+        protocol::endpoint(p.path),
+        [self = shared_from_this(), &p](error_code ec)
+        {
+            if (!ec)
+            {
+                p.connected = true;
+                return;
+            }
+
+            // The sibling is not up yet, try again later
+            p.socket.close(ec);
+            p.timer.expires_after(std::chrono::seconds(1));
+            p.timer.async_wait(
+                [self, &p](error_code ec)
+                {
+                    if (!ec)
+                        self->do_connect(p);
+                });
+        });
+}
+
+void local_bus::
+    publish(message_ptr const &msg)
+{
+    net::post(
+        strand_,
+        [self = shared_from_this(), msg]
+        {
+            self->on_publish(msg);
+        });
+}
+
+void local_bus::
+    on_publish(message_ptr const &msg)
+{
+    // The siblings get the label too, they deliver the same bytes
+    auto const body = msg->data();
+    auto const &topic = msg->topic();
+    if (topic.size() > 0xffff)
+        return;
+    std::size_t const size = 3 + topic.size() + msg->size();
+    if (size > 0xffffffff)
+        return;
+
+    unsigned char header[7];
+    header[0] = static_cast<unsigned char>(size >> 24);
+    header[1] = static_cast<unsigned char>(size >> 16);
+    header[2] = static_cast<unsigned char>(size >> 8);
+    header[3] = static_cast<unsigned char>(size);
+    header[4] = (msg->binary() ? 1 : 0) |
+        (msg->priority() == message_priority::high ? 2 : 0);
+    header[5] = static_cast<unsigned char>(topic.size() >> 8);
+    header[6] = static_cast<unsigned char>(topic.size());
+
+    for (auto const &pp : peers_)
+    {
+        auto &p = *pp;
+        if (!p.connected)
+            continue;
+        if (p.pending.size() + 4 + size > max_pending)
+        {
+            ++state_->stats().bus_dropped;
+            continue;
+        }
+        p.pending.append(reinterpret_cast<char const *>(header), sizeof(header));
+        p.pending.append(topic);
+        for (auto const &b : body)
+            p.pending.append(static_cast<char const *>(b.data()), b.size());
+
+        // Otherwise the frame goes out with the next batch
+        if (p.writing.empty())
+            do_write(p);
+    }
+}
+
+void local_bus::
+    do_write(peer &p)
+{
+    p.writing.swap(p.pending);
+    net::async_write(
+        p.socket,
+        net::buffer(p.writing),
+        [self = shared_from_this(), &p](error_code ec, std::size_t)
+        {
+            self->on_write(p, ec);
+        });
+}
+
+void local_bus::
+    on_write(peer &p, error_code ec)
+{
+    p.writing.clear();
+    if (ec)
+    {
+        // Drop what was queued and wait for the sibling to return
+        fail(ec, "bus write");
+        p.connected = false;
+        p.pending.clear();
+        p.socket.close(ec);
+        return do_connect(p);
+    }
+    if (!p.pending.empty())
+        do_write(p);
+}
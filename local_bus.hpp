@@ -0,0 +1,104 @@
+#ifndef IR_WEBSOCKET_SERVER_LOCAL_BUS_HPP
+#define IR_WEBSOCKET_SERVER_LOCAL_BUS_HPP
+
+#include "beast.hpp"
+#include "message.hpp"
+#include "net.hpp"
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Forward declaration
+class shared_state;
+
+/** Relays broadcasts between server processes on the same host
+
+    Every process listens on a Unix domain socket of its own and
+    connects to the sockets of its siblings. Each broadcast made
+    by a local client is written to every sibling as a bus frame
+
+        uint32 size, uint8 flags, uint16 topic size, topic, payload
+
+    with the integers in network byte order and `size` counting
+    everything after itself. The flags are 1 for binary and 2 for
+    high priority. Frames queued while a write is in
+    progress are batched into the next write, so a burst costs
+    one system call per sibling instead of one per message.
+
+    A process delivers the frames it receives to its own sessions
+    only, so a message crosses the bus at most once.
+*/
+class local_bus : public std::enable_shared_from_this<local_bus>
+{
+    using protocol = net::local::stream_protocol;
+
+    // A sibling we write to
+    struct peer
+    {
+        std::string path;
+        protocol::socket socket;
+        net::steady_timer timer;
+        std::string pending;
+        std::string writing;
+        bool connected = false;
+
+        peer(net::strand<net::io_context::executor_type> const &ex, std::string path_);
+    };
+
+    // A sibling we read from
+    struct inbound
+    {
+        protocol::socket socket;
+        beast::flat_buffer buffer;
+
+        explicit inbound(protocol::socket socket_);
+    };
+
+    // Frames for a sibling which is this far behind are dropped
+    static constexpr std::size_t max_pending = 64 * 1024 * 1024;
+
+    net::strand<net::io_context::executor_type> strand_;
+    protocol::acceptor acceptor_;
+    std::vector<std::unique_ptr<peer>> peers_;
+    std::shared_ptr<shared_state> state_;
+    std::string path_;
+
+    void fail(error_code ec, char const *what);
+    void do_accept();
+    void do_read(std::shared_ptr<inbound> in);
+    bool on_frames(beast::flat_buffer &buffer);
+    void do_connect(peer &p);
+    void on_publish(message_ptr const &msg);
+    void do_write(peer &p);
+    void on_write(peer &p, error_code ec);
+
+public:
+    /** Constructor
+
+        @param ioc The io_context to run the bus on. With the
+        shared-nothing engine this must be the one of `state`.
+
+        @param state Where to deliver the messages received from
+        the siblings.
+
+        @param path The socket this process listens on.
+
+        @param peers The sockets of the sibling processes.
+    */
+    local_bus(
+        net::io_context &ioc,
+        std::shared_ptr<shared_state> const &state,
+        std::string path,
+        std::vector<std::string> const &peers);
+
+    ~local_bus();
+
+    // Start accepting and connecting to the siblings
+    void run();
+
+    // Send a message to every sibling, may be called from any thread
+    void publish(message_ptr const &msg);
+};
+
+#endif
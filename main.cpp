@@ -1,6 +1,15 @@
+#include "engine.hpp"
 #include "listener.hpp"
+#include "local_bus.hpp"
+#include "message_log.hpp"
+#include "server_options.hpp"
 #include "shared_state.hpp"
+#include "shm_ring.hpp"
+#include <algorithm>
 #include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
 #include "common/server_certificate.hpp"
 
 namespace ssl = boost::asio::ssl;
@@ -8,46 +17,288 @@ namespace ssl = boost::asio::ssl;
 int main(int argc, char* argv[])
 {
     // Check command line arguments.
-    if (argc != 4)
+    server_options opts;
+    bool usage = argc < 4;
+    for (int i = 4; !usage && i < argc; ++i)
+    {
+        std::string const arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc)
+            opts.threads = std::max<int>(1, std::atoi(argv[++i]));
+        else if (arg == "--reuseport")
+            opts.reuse_port = true;
+        else if (arg == "--shared-nothing")
+            opts.shared_nothing = opts.reuse_port = true;
+        else if (arg == "--preframed")
+            opts.preframed = true;
+        else if (arg == "--deflate")
+            opts.deflate = true;
+        else if (arg == "--queue-limit" && i + 1 < argc)
+            opts.queue_limit = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--queue-limit-bytes" && i + 1 < argc)
+            opts.queue_limit_bytes = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--coalesce" && i + 1 < argc)
+            opts.coalesce = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--batch-window" && i + 1 < argc)
+            opts.batch_window = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--priority-topic" && i + 1 < argc)
+            opts.priority_topics.emplace_back(argv[++i]);
+        else if (arg == "--history" && i + 1 < argc)
+            opts.history = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--history-topics" && i + 1 < argc)
+            opts.history_topics = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--replay-limit" && i + 1 < argc)
+            opts.replay_limit = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--rate-limit" && i + 1 < argc)
+            opts.rate_limit = std::atof(argv[++i]);
+        else if (arg == "--rate-limit-bytes" && i + 1 < argc)
+            opts.rate_limit_bytes = std::atof(argv[++i]);
+        else if (arg == "--subject-rate-limit" && i + 1 < argc)
+            opts.subject_rate_limit = std::atof(argv[++i]);
+        else if (arg == "--subject-rate-limit-bytes" && i + 1 < argc)
+            opts.subject_rate_limit_bytes = std::atof(argv[++i]);
+        else if (arg == "--rate-policy" && i + 1 < argc)
+        {
+            std::string const policy = argv[++i];
+            if (policy == "delay")
+                opts.rate_policy = rate_limit_policy::delay;
+            else if (policy == "drop")
+                opts.rate_policy = rate_limit_policy::drop;
+            else
+                usage = true;
+        }
+        else if (arg == "--presence-window" && i + 1 < argc)
+            opts.presence_window = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--no-presence")
+            opts.presence = false;
+        else if (arg == "--bus" && i + 1 < argc)
+            opts.bus_path = argv[++i];
+        else if (arg == "--bus-peer" && i + 1 < argc)
+            opts.bus_peers.emplace_back(argv[++i]);
+        else if (arg == "--shm" && i + 1 < argc)
+            opts.shm_name = argv[++i];
+        else if (arg == "--shm-size" && i + 1 < argc)
+            opts.shm_size = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--log" && i + 1 < argc)
+            opts.log_dir = argv[++i];
+        else if (arg == "--log-segment-size" && i + 1 < argc)
+            opts.log_segment_size = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--log-retention" && i + 1 < argc)
+            opts.log_retention = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--read-message-max" && i + 1 < argc)
+            opts.read_message_max = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--stream-chunk" && i + 1 < argc)
+            opts.stream_chunk = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--stream-memory" && i + 1 < argc)
+            opts.stream_memory = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--stream-timeout" && i + 1 < argc)
+            opts.stream_timeout = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--stream-deadline" && i + 1 < argc)
+            opts.stream_deadline = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--pool-memory" && i + 1 < argc)
+            opts.pool_memory = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--slow-consumer" && i + 1 < argc)
+        {
+            std::string const policy = argv[++i];
+            if (policy == "drop-oldest")
+                opts.slow_consumer = slow_consumer_policy::drop_oldest;
+            else if (policy == "drop-newest")
+                opts.slow_consumer = slow_consumer_policy::drop_newest;
+            else if (policy == "disconnect")
+                opts.slow_consumer = slow_consumer_policy::disconnect;
+            else
+                usage = true;
+        }
+        else
+            usage = true;
+    }
+    if (usage)
     {
         std::cerr <<
-            "Usage: ir-websocket-server <address> <port> <doc_root>\n" <<
+            "Usage: ir-websocket-server <address> <port> <doc_root> [options]\n" <<
+            "Options:\n" <<
+            "    --threads N        run N threads\n" <<
+            "    --reuseport        one SO_REUSEPORT listener per thread\n" <<
+            "    --shared-nothing   one server state shard per thread\n" <<
+            "    --preframed        serialize broadcast frames once\n" <<
+            "    --deflate          negotiate permessage-deflate\n" <<
+            "    --queue-limit N    at most N queued messages per session\n" <<
+            "    --queue-limit-bytes N\n" <<
+            "                       at most N queued bytes per session\n" <<
+            "    --slow-consumer drop-oldest|drop-newest|disconnect\n" <<
+            "                       what to do when a queue is full\n" <<
+            "    --coalesce N       gather up to N queued frames per write\n" <<
+            "    --batch-window US  batch broadcasts over US microseconds\n" <<
+            "                       when busy\n" <<
+            "    --priority-topic T send topic T ahead of other traffic\n" <<
+            "    --history N        keep the last N broadcasts per topic\n" <<
+            "    --history-topics N keep the history of at most N topics\n" <<
+            "    --replay-limit N   resend at most N messages per /replay\n" <<
+            "    --rate-limit N     at most N inbound messages/s per session\n" <<
+            "    --rate-limit-bytes N\n" <<
+            "                       at most N inbound bytes/s per session\n" <<
+            "    --subject-rate-limit N\n" <<
+            "    --subject-rate-limit-bytes N\n" <<
+            "                       the same limits per JWT subject, per shard\n" <<
+            "                       with --shared-nothing\n" <<
+            "    --rate-policy delay|drop\n" <<
+            "                       what to do with a message over the limit\n" <<
+            "    --presence-window MS\n" <<
+            "                       batch joins and leaves over MS milliseconds\n" <<
+            "    --no-presence      do not announce joins and leaves\n" <<
+            "    --bus PATH         listen for sibling processes on PATH\n" <<
+            "    --bus-peer PATH    relay broadcasts to the sibling at PATH\n" <<
+            "    --shm NAME         share broadcasts through /dev/shm/NAME\n" <<
+            "    --shm-size N       size in bytes of a new /dev/shm ring\n" <<
+            "    --log DIR          log every broadcast to files in DIR\n" <<
+            "    --log-segment-size N\n" <<
+            "                       size in bytes of each log file\n" <<
+            "    --log-retention N  keep at most N bytes of log files\n" <<
+            "    --read-message-max N\n" <<
+            "                       accept messages of at most N bytes\n" <<
+            "    --stream-chunk N   relay larger messages in N byte pieces\n" <<
+            "    --stream-memory N  hold at most N streamed bytes per reader\n" <<
+            "    --stream-timeout MS\n" <<
+            "                       wait at most MS milliseconds for the next piece\n" <<
+            "    --stream-deadline MS\n" <<
+            "                       let a streamed message take at most MS milliseconds\n" <<
+            "    --pool-memory N    keep N bytes of closed sessions per thread\n" <<
             "Example:\n" <<
-            "    ir-websocket-server 0.0.0.0 8080 .\n";
+            "    ir-websocket-server 0.0.0.0 8080 .\n" <<
+            "    ir-websocket-server 0.0.0.0 8080 . --threads 4\n" <<
+            "    ir-websocket-server 0.0.0.0 8080 . --threads 4 --shared-nothing\n" <<
+            "    ir-websocket-server 0.0.0.0 8080 . --bus /tmp/a.sock --bus-peer /tmp/b.sock\n";
         return EXIT_FAILURE;
     }
     auto address = net::ip::make_address(argv[1]);
     auto port = static_cast<unsigned short>(std::atoi(argv[2]));
     auto doc_root = argv[3];
+    // Connection ids only have room to number so many shards
+    if (opts.shared_nothing)
+        opts.threads = std::min<int>(opts.threads, engine::max_shards);
+    auto const threads = opts.threads;
 
-    // The io_context is required for all I/O
-    net::io_context ioc;
+    // The io_context is required for all I/O. With --reuseport every
+    // thread gets its own io_context and its own listening socket,
+    // otherwise all the threads share a single io_context.
+    auto const contexts = opts.reuse_port ? threads : 1;
+    std::vector<std::unique_ptr<net::io_context>> iocs;
+    iocs.reserve(contexts);
+    for (auto i = 0; i < contexts; ++i)
+        iocs.emplace_back(std::make_unique<net::io_context>(
+            opts.reuse_port ? 1 : threads));
 
     ssl::context ctx{ssl::context::tlsv13};
     // This holds the self-signed certificate used by the server
     setup_ssl_context(ctx);
 
-    // Create and launch a listening port
-    std::make_shared<listener>(
-        ioc,
-        tcp::endpoint{address, port},
-        std::make_shared<shared_state>(doc_root))->run();
+    // With --shared-nothing every io_context gets its own shard of
+    // the server state, otherwise all the listeners share one.
+    std::unique_ptr<engine> shards;
+    std::shared_ptr<shared_state> state;
+    if (opts.shared_nothing)
+        shards = std::make_unique<engine>(iocs, doc_root, opts);
+    else
+    {
+        state = std::make_shared<shared_state>(doc_root, opts);
+        state->start(*iocs.front());
+    }
+
+    // Every shard, or the single state, hands its broadcasts to
+    // the relays to the sibling processes
+    auto const attach = [&](auto *relay)
+    {
+        if (shards)
+            for (std::size_t i = 0; i < shards->size(); ++i)
+                shards->state(i)->attach(relay);
+        else
+            state->attach(relay);
+    };
+
+    // Write the broadcasts to disk, before any is numbered
+    std::unique_ptr<message_log> log;
+    if (!opts.log_dir.empty())
+    {
+        log = std::make_unique<message_log>(
+            opts.log_dir, opts.log_segment_size, opts.log_retention);
+        attach(log.get());
+    }
+
+    // Relay broadcasts to the sibling processes. Messages from the
+    // siblings enter through the first shard, which hands them to
+    // the others.
+    std::shared_ptr<local_bus> bus;
+    if (!opts.bus_path.empty())
+    {
+        bus = std::make_shared<local_bus>(
+            *iocs.front(),
+            shards ? shards->state(0) : state,
+            opts.bus_path,
+            opts.bus_peers);
+        attach(bus.get());
+        bus->run();
+    }
+    std::shared_ptr<shm_ring> shm;
+    if (!opts.shm_name.empty())
+    {
+        shm = std::make_shared<shm_ring>(
+            *iocs.front(),
+            shards ? shards->state(0) : state,
+            opts.shm_name,
+            opts.shm_size);
+        if (shm->is_open())
+        {
+            attach(shm.get());
+            shm->run();
+        }
+    }
+
+    // Create and launch a listening port on each io_context
+    for (std::size_t i = 0; i < iocs.size(); ++i)
+        std::make_shared<listener>(
+            *iocs[i],
+            tcp::endpoint{address, port},
+            shards ? shards->state(i) : state,
+            opts.reuse_port)->run();
 
     // Capture SIGINT and SIGTERM to perform a clean shutdown
-    net::signal_set signals(ioc, SIGINT, SIGTERM);
+    net::signal_set signals(*iocs.front(), SIGINT, SIGTERM);
     signals.async_wait(
-        [&ioc](boost::system::error_code const&, int)
+        [&iocs](boost::system::error_code const&, int)
         {
-            // Stop the io_context. This will cause run()
+            // Stop the io_contexts. This will cause run()
             // to return immediately, eventually destroying the
-            // io_context and any remaining handlers in it.
-            ioc.stop();
+            // io_contexts and any remaining handlers in them.
+            for (auto &ioc : iocs)
+                ioc->stop();
         });
 
-    // Run the I/O service on the main thread
-    ioc.run();
+    // Run the I/O service on the requested number of threads,
+    // spreading the threads evenly across the io_contexts
+    std::vector<std::thread> v;
+    v.reserve(threads - 1);
+    for (auto i = threads - 1; i > 0; --i)
+        v.emplace_back(
+            [&ioc = *iocs[i % contexts]]
+            {
+                ioc.run();
+            });
+    iocs.front()->run();
 
     // (If we get here, it means we got a SIGINT or SIGTERM)
 
+    // Block until all the threads exit
+    for (auto &t : v)
+        t.join();
+
+    // Sessions destroyed along with the io_contexts
+    // must no longer forward to the other shards
+    if (shards)
+        shards->detach();
+
+    // Nor to the sibling processes
+    attach(static_cast<local_bus *>(nullptr));
+    attach(static_cast<shm_ring *>(nullptr));
+    attach(static_cast<message_log *>(nullptr));
+
     return EXIT_SUCCESS;
 }
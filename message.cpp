@@ -0,0 +1,226 @@
+#include "message.hpp"
+#include "beast.hpp"
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+// See RFC 6455 section 5.2
+std::size_t
+write_frame_header(
+    unsigned char *p,
+    std::uint64_t n,
+    bool binary,
+    bool deflated)
+{
+    // FIN with the opcode, and RSV1 for a compressed message
+    p[0] = (binary ? 0x82 : 0x81) | (deflated ? 0x40 : 0);
+    if (n < 126)
+    {
+        p[1] = static_cast<unsigned char>(n);
+        return 2;
+    }
+    if (n <= 0xffff)
+    {
+        p[1] = 126;
+        p[2] = static_cast<unsigned char>(n >> 8);
+        p[3] = static_cast<unsigned char>(n);
+        return 4;
+    }
+    p[1] = 127;
+    for (int i = 0; i < 8; ++i)
+        p[2 + i] = static_cast<unsigned char>(n >> (56 - 8 * i));
+    return 10;
+}
+
+// Construct a message at the start of a block of `size` bytes
+template <class... Args>
+mutable_message_ptr
+message::
+    create(std::size_t size, Args &&...args)
+{
+    auto const c = slab_allocator::size_class(size);
+    auto const p = slab_allocator::allocate(c, size);
+    message *m;
+    try
+    {
+        m = new (p) message(std::forward<Args>(args)...);
+    }
+    catch (...)
+    {
+        slab_allocator::deallocate(p, c);
+        throw;
+    }
+    m->class_ = c;
+    return mutable_message_ptr(m);
+}
+
+mutable_message_ptr
+make_message(
+    std::string payload,
+    std::string topic,
+    bool binary)
+{
+    // Too large for a block, keep the string as it is
+    auto const size = sizeof(message) + payload.size();
+    if (slab_allocator::size_class(size) == slab_allocator::classes)
+        return message::create(
+            sizeof(message), std::move(payload), std::move(topic), binary);
+
+    // Copy the bytes right behind the message, in the same block
+    auto m = message::create(size, std::string(), std::move(topic), binary);
+    auto const data = reinterpret_cast<char *>(m.get() + 1);
+    std::memcpy(data, payload.data(), payload.size());
+    m->payload_ = message::external{
+        net::const_buffer(data, payload.size()), nullptr};
+    return m;
+}
+
+mutable_message_ptr
+make_message(
+    beast::flat_buffer payload,
+    std::string topic,
+    bool binary)
+{
+    return message::create(
+        sizeof(message), std::move(payload), std::move(topic), binary);
+}
+
+mutable_message_ptr
+make_message(
+    net::const_buffer payload,
+    std::shared_ptr<void const> owner,
+    std::string topic,
+    bool binary)
+{
+    return message::create(
+        sizeof(message),
+        payload,
+        std::move(owner),
+        std::move(topic),
+        binary);
+}
+
+void message::
+    make_frame()
+{
+    header_size_ = write_frame_header(
+        header_.data(), size(), binary_);
+}
+
+net::const_buffer
+message::
+    payload() const noexcept
+{
+    if (auto const s = std::get_if<std::string>(&payload_))
+        return net::buffer(*s);
+    if (auto const b = std::get_if<beast::flat_buffer>(&payload_))
+        return b->data();
+    return std::get<external>(payload_).data;
+}
+
+void message::
+    set_sequence(std::uint64_t seq)
+{
+    sequence_ = seq;
+
+    // Binary data and JSON documents must stay as they are
+    auto const body = payload();
+    auto const p = static_cast<char const *>(body.data());
+    if (binary_ || (body.size() > 0 && (p[0] == '{' || p[0] == '[')))
+        return;
+    label_size_ = static_cast<std::size_t>(std::snprintf(
+        label_.data(), label_.size(), "#%llu ",
+        static_cast<unsigned long long>(seq)));
+}
+
+void message::
+    make_deflated_frames(int level, int mem_level)
+{
+    deflate_level_ = level;
+    deflate_mem_level_ = mem_level;
+    deflated_.reset(new std::array<
+        deflated, max_window_bits - min_window_bits + 1>);
+}
+
+std::array<net::const_buffer, 3>
+message::
+    frame(int window_bits) const
+{
+    if (window_bits != 0 && deflated_)
+    {
+        // A message which failed to compress goes out as it is,
+        // with RSV1 clear, which the extension allows
+        auto const &frame = deflate(window_bits);
+        if (!frame.empty())
+            return {{net::buffer(frame), {}, {}}};
+    }
+    return {{
+        net::buffer(header_.data(), header_size_),
+        net::buffer(label_.data(), label_size_),
+        payload()}};
+}
+
+std::string const &
+message::
+    deflate(int window_bits) const
+{
+    if (window_bits < min_window_bits)
+        window_bits = min_window_bits;
+    if (window_bits > max_window_bits)
+        window_bits = max_window_bits;
+    auto &d = (*deflated_)[window_bits - min_window_bits];
+    std::call_once(d.once, [&]
+    {
+        // The compressor is reused by every message
+        // built on this thread, to save its allocations
+        thread_local beast::zlib::deflate_stream zo;
+        zo.reset(
+            deflate_level_,
+            window_bits,
+            deflate_mem_level_,
+            beast::zlib::Strategy::normal);
+
+        auto const body = payload();
+        thread_local std::string buf;
+        buf.resize(zo.upper_bound(size()) + 6);
+        beast::zlib::z_params zs;
+        zs.next_in = label_.data();
+        zs.avail_in = label_size_;
+        zs.next_out = &buf[0];
+        zs.avail_out = buf.size();
+
+        // need_buffers only means the input was used up
+        auto const write = [&](beast::zlib::Flush flush)
+        {
+            error_code ec;
+            zo.write(zs, flush, ec);
+            return !ec || ec == beast::zlib::error::need_buffers;
+        };
+
+        // Same sequence as the websocket stream uses: compress
+        // everything, end the block, then flush and remove the
+        // trailing 00 00 ff ff marker (RFC 7692 section 7.2.1).
+        // On any error the frame is left empty.
+        bool ok = write(beast::zlib::Flush::none);
+        zs.next_in = body.data();
+        zs.avail_in = body.size();
+        ok = ok &&
+             write(beast::zlib::Flush::none) &&
+             write(beast::zlib::Flush::block) &&
+             write(beast::zlib::Flush::full) &&
+             zs.avail_in == 0 &&
+             zs.avail_out != 0 &&
+             zs.total_out >= 4 &&
+             buf.compare(zs.total_out - 4, 4, "\x00\x00\xff\xff", 4) == 0;
+        if (!ok)
+            return;
+        auto const n = zs.total_out - 4;
+
+        unsigned char header[10];
+        auto const header_size = write_frame_header(header, n, binary_, true);
+        d.frame.reserve(header_size + n);
+        d.frame.append(reinterpret_cast<char const *>(header), header_size);
+        d.frame.append(buf.data(), n);
+    });
+    return d.frame;
+}
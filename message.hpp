@@ -0,0 +1,361 @@
+#ifndef IR_WEBSOCKET_SERVER_MESSAGE_HPP
+#define IR_WEBSOCKET_SERVER_MESSAGE_HPP
+
+#include "beast.hpp"
+#include "net.hpp"
+#include "session_pool.hpp"
+#include "slab_allocator.hpp"
+#include <boost/smart_ptr/intrusive_ptr.hpp>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <variant>
+
+// The queues of a session's outgoing messages, in the
+// order they are written
+enum class message_priority
+{
+    // Control traffic and high priority topics
+    high,
+
+    // Everything else
+    normal
+};
+
+class message;
+
+// A message which is still being built
+using mutable_message_ptr = boost::intrusive_ptr<message>;
+
+/** An outgoing message, shared read-only by all of its recipients
+
+    The payload is either a string, the very buffer a session
+    read the message into, so that a relayed message is never
+    copied after it leaves the kernel, or bytes owned by someone
+    else such as a shared memory mapping. The message remembers
+    whether it is text or binary.
+
+    A numbered plain text message is written after a "#<seq> "
+    label, which is kept apart from the payload so the payload is
+    never copied to number it. Binary and JSON payloads have no
+    label and reach the recipients exactly as they were sent.
+
+    A message normally carries just its payload, which each
+    websocket_session frames as it writes it. A message may also
+    carry a pre-serialized frame header: since server-to-client
+    frames are never masked, the framed bytes are identical for
+    every recipient and can be written straight to the socket.
+
+    A pre-framed message may additionally be compressed for the
+    permessage-deflate extension. The compressed frame is built
+    the first time a session asks for it and is then shared by
+    every session which negotiated the same server window size.
+    This requires "server_no_context_takeover", so that each
+    message is compressed independently of the ones before it.
+
+    Messages are made with make_message, which allocates them from
+    the slab_allocator, and are shared through an intrusive count.
+    A small string payload is copied right behind the message, so
+    that the message and its bytes take a single block. A read
+    buffer taken over from a session may go back to the
+    session_pool once the message is released, so that relaying
+    does not grow a new buffer for every message read.
+*/
+class message
+{
+    struct deflated
+    {
+        std::once_flag once;
+        std::string frame;
+    };
+
+    // Window sizes 9 through 15 bits, see RFC 7692
+    static constexpr int min_window_bits = 9;
+    static constexpr int max_window_bits = 15;
+
+    // Bytes kept alive by `owner`, or following
+    // the message itself when `owner` is null
+    struct external
+    {
+        net::const_buffer data;
+        std::shared_ptr<void const> owner;
+    };
+
+    std::variant<std::string, beast::flat_buffer, external> payload_;
+
+    // Bytes the session_pool may keep of a read buffer payload
+    std::size_t recycle_ = 0;
+
+    std::string topic_;
+    std::uint64_t sequence_ = 0;
+
+    // "#<seq> " for a numbered plain text message
+    std::array<char, 22> label_{};
+    std::size_t label_size_ = 0;
+
+    bool binary_;
+    message_priority priority_ = message_priority::normal;
+
+    // Set on the pieces of a message relayed as it is read
+    std::shared_ptr<void const> stream_;
+    bool first_ = true;
+    bool fin_ = true;
+    std::array<unsigned char, 10> header_{};
+    std::size_t header_size_ = 0;
+
+    int deflate_level_ = 0;
+    int deflate_mem_level_ = 0;
+    mutable std::unique_ptr<
+        std::array<deflated, max_window_bits - min_window_bits + 1>> deflated_;
+
+#ifdef BOOST_ASIO_DISABLE_THREADS
+    // Without threads, the count needs no atomic operations
+    using refcount = std::size_t;
+#else
+    using refcount = std::atomic<std::size_t>;
+#endif
+
+    mutable refcount refs_{0};
+
+    // The slab_allocator class of the block holding the message
+    std::size_t class_ = slab_allocator::classes;
+
+    // Returns the compressed frame, or an empty
+    // string if the message could not be compressed
+    std::string const &deflate(int window_bits) const;
+
+    template <class... Args>
+    static mutable_message_ptr create(std::size_t size, Args &&...args);
+
+    friend mutable_message_ptr make_message(
+        std::string, std::string, bool);
+    friend mutable_message_ptr make_message(
+        beast::flat_buffer, std::string, bool);
+    friend mutable_message_ptr make_message(
+        net::const_buffer, std::shared_ptr<void const>, std::string, bool);
+
+    friend void
+    intrusive_ptr_add_ref(message const *m) noexcept
+    {
+        ++m->refs_;
+    }
+
+    friend void
+    intrusive_ptr_release(message const *m) noexcept
+    {
+        if (--m->refs_ != 0)
+            return;
+        auto const c = m->class_;
+        auto const p = const_cast<message *>(m);
+        auto const b = std::get_if<beast::flat_buffer>(&p->payload_);
+        if (b && p->recycle_ != 0)
+            session_pool::local().give_back(std::move(*b), p->recycle_);
+        p->~message();
+        slab_allocator::deallocate(p, c);
+    }
+
+public:
+    explicit message(
+        std::string payload,
+        std::string topic = {},
+        bool binary = false)
+        : payload_(std::move(payload))
+        , topic_(std::move(topic))
+        , binary_(binary)
+    {
+    }
+
+    explicit message(
+        beast::flat_buffer payload,
+        std::string topic = {},
+        bool binary = false)
+        : payload_(std::move(payload))
+        , topic_(std::move(topic))
+        , binary_(binary)
+    {
+    }
+
+    message(
+        net::const_buffer payload,
+        std::shared_ptr<void const> owner,
+        std::string topic = {},
+        bool binary = false)
+        : payload_(external{payload, std::move(owner)})
+        , topic_(std::move(topic))
+        , binary_(binary)
+    {
+    }
+
+    net::const_buffer
+    payload() const noexcept;
+
+    // Give a read buffer payload back to the session_pool of the
+    // thread releasing the message, for the next read of a session
+    void
+    recycle(std::size_t limit) noexcept
+    {
+        recycle_ = limit;
+    }
+
+    // The bytes sent to the recipients, the label then the payload
+    std::array<net::const_buffer, 2>
+    data() const noexcept
+    {
+        return {{net::buffer(label_.data(), label_size_), payload()}};
+    }
+
+    std::size_t
+    size() const noexcept
+    {
+        return label_size_ + payload().size();
+    }
+
+    bool
+    binary() const noexcept
+    {
+        return binary_;
+    }
+
+    message_priority
+    priority() const noexcept
+    {
+        return priority_;
+    }
+
+    void
+    set_priority(message_priority p) noexcept
+    {
+        priority_ = p;
+    }
+
+    /** Make this message one piece of a streamed message
+
+        @param stream Identifies the streamed message, shared by
+        all of its pieces.
+
+        @param first Whether this is the first piece.
+
+        @param fin Whether this is the last piece.
+    */
+    void
+    set_fragment(
+        std::shared_ptr<void const> stream,
+        bool first,
+        bool fin) noexcept
+    {
+        stream_ = std::move(stream);
+        first_ = first;
+        fin_ = fin;
+    }
+
+    // Returns true if the message is one piece of a streamed message
+    bool
+    fragment() const noexcept
+    {
+        return stream_ != nullptr;
+    }
+
+    void const *
+    stream() const noexcept
+    {
+        return stream_.get();
+    }
+
+    bool
+    first() const noexcept
+    {
+        return first_;
+    }
+
+    bool
+    fin() const noexcept
+    {
+        return fin_;
+    }
+
+    // The topic the message was published to,
+    // empty if it goes to every session
+    std::string const &
+    topic() const noexcept
+    {
+        return topic_;
+    }
+
+    // The position of the message in the history, zero if
+    // the message is not kept in the history
+    std::uint64_t
+    sequence() const noexcept
+    {
+        return sequence_;
+    }
+
+    // Number the message, labelling a plain text payload
+    void set_sequence(std::uint64_t seq);
+
+    // Build the header of a single unfragmented frame
+    void make_frame();
+
+    // Also allow compressed frames to be built on demand
+    void make_deflated_frames(int level, int mem_level);
+
+    // Returns true if the message has a pre-built frame
+    bool
+    framed() const noexcept
+    {
+        return header_size_ != 0;
+    }
+
+    /** The complete frame, header followed by label and payload
+
+        @param window_bits The server window size negotiated by
+        the recipient for permessage-deflate, or zero if the
+        recipient did not negotiate compression.
+    */
+    std::array<net::const_buffer, 3>
+    frame(int window_bits = 0) const;
+};
+
+using message_ptr = boost::intrusive_ptr<message const>;
+
+/** Make a message, allocated from the slab_allocator
+
+    The overloads take the same arguments as the constructors.
+    A string payload small enough is copied into the block of
+    the message.
+*/
+mutable_message_ptr make_message(
+    std::string payload,
+    std::string topic = {},
+    bool binary = false);
+
+mutable_message_ptr make_message(
+    beast::flat_buffer payload,
+    std::string topic = {},
+    bool binary = false);
+
+mutable_message_ptr make_message(
+    net::const_buffer payload,
+    std::shared_ptr<void const> owner,
+    std::string topic = {},
+    bool binary = false);
+
+/** Serialize the header of an unmasked, unfragmented frame
+
+    @param p Where to write the header, at least 10 bytes.
+    @param size The length of the payload.
+    @param binary Whether to use the binary opcode instead of text.
+    @param deflated Whether the payload is compressed.
+    @return The length of the header.
+*/
+std::size_t
+write_frame_header(
+    unsigned char *p,
+    std::uint64_t size,
+    bool binary = false,
+    bool deflated = false);
+
+#endif
@@ -0,0 +1,93 @@
+#include "message_history.hpp"
+#include <algorithm>
+#include <atomic>
+
+std::atomic<std::uint64_t> message_history::sequence_{0};
+
+message_history::
+    message_history(std::size_t capacity, std::size_t max_topics)
+    : capacity_(capacity), max_topics_(max_topics), all_(capacity)
+{
+}
+
+std::uint64_t
+message_history::
+    next_sequence() noexcept
+{
+    return ++sequence_;
+}
+
+void message_history::
+    skip_sequence(std::uint64_t seq) noexcept
+{
+    auto cur = sequence_.load();
+    while (cur < seq && !sequence_.compare_exchange_weak(cur, seq))
+        ;
+}
+
+void message_history::
+    record(message_ptr const &msg)
+{
+    if (!msg->topic().empty() && max_topics_ == 0)
+        return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto &r = msg->topic().empty() ? all_ : ring(msg->topic());
+    if (r.size() == capacity_)
+        r.pop_front();
+    r.push_back(msg);
+}
+
+// Returns the ring of a topic, making it the most recent
+// one, and forgetting the least recent topic if needed
+ring_buffer<message_ptr> &
+message_history::
+    ring(std::string const &name)
+{
+    auto it = topics_.find(name);
+    if (it != topics_.end())
+    {
+        recent_.splice(recent_.begin(), recent_, it->second.recent);
+        return it->second.ring;
+    }
+
+    if (topics_.size() >= max_topics_ && !recent_.empty())
+    {
+        topics_.erase(recent_.back());
+        recent_.pop_back();
+    }
+    recent_.push_front(name);
+    return topics_.emplace(
+                      name,
+                      topic{ring_buffer<message_ptr>(capacity_), recent_.begin()})
+        .first->second.ring;
+}
+
+std::vector<message_ptr>
+message_history::
+    since(std::uint64_t seq, std::string const &topic)
+{
+    std::vector<message_ptr> v;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto const *ring = &all_;
+        if (!topic.empty())
+        {
+            auto const it = topics_.find(topic);
+            if (it == topics_.end())
+                return v;
+            ring = &it->second.ring;
+        }
+        for (std::size_t i = 0; i < ring->size(); ++i)
+            if ((*ring)[i]->sequence() > seq)
+                v.push_back((*ring)[i]);
+    }
+
+    // Messages relayed from other shards or recorded by other
+    // threads may have arrived slightly out of order
+    std::sort(v.begin(), v.end(),
+              [](message_ptr const &a, message_ptr const &b)
+              {
+                  return a->sequence() < b->sequence();
+              });
+    return v;
+}
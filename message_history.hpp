@@ -0,0 +1,69 @@
+#ifndef IR_WEBSOCKET_SERVER_MESSAGE_HISTORY_HPP
+#define IR_WEBSOCKET_SERVER_MESSAGE_HISTORY_HPP
+
+#include "message.hpp"
+#include "ring_buffer.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/** The most recent broadcasts, kept for reconnect catch-up
+
+    The history holds the same shared messages that were sent
+    to the sessions, so replaying them to a client costs no
+    serialization and no copy. There is one bounded ring for
+    the messages sent to everyone, and one for each topic.
+
+    Clients can publish to any number of topics, so the number
+    of topic rings is bounded too. When a message is recorded
+    for a new topic and there are too many, the ring of the
+    topic which went the longest without a message is dropped.
+*/
+class message_history
+{
+    static std::atomic<std::uint64_t> sequence_;
+
+    struct topic
+    {
+        ring_buffer<message_ptr> ring;
+
+        // The topic's position in recent_
+        std::list<std::string>::iterator recent;
+    };
+
+    std::mutex mutex_;
+    std::size_t capacity_;
+    std::size_t max_topics_;
+    ring_buffer<message_ptr> all_;
+    std::unordered_map<std::string, topic> topics_;
+
+    // The topics, the most recently recorded first
+    std::list<std::string> recent_;
+
+    ring_buffer<message_ptr> &ring(std::string const &name);
+
+public:
+    message_history(std::size_t capacity, std::size_t max_topics);
+
+    // Returns the next sequence number, shared by the whole process
+    static std::uint64_t next_sequence() noexcept;
+
+    // Make the next sequence numbers greater than `seq`
+    static void skip_sequence(std::uint64_t seq) noexcept;
+
+    // Remember a message, dropping the oldest one if full
+    void record(message_ptr const &msg);
+
+    // Returns the messages of a topic (or sent to everyone, if
+    // the topic is empty) with a sequence number greater than
+    // `seq`, in sequence order
+    std::vector<message_ptr>
+    since(std::uint64_t seq, std::string const &topic);
+};
+
+#endif
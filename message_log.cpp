@@ -0,0 +1,347 @@
+#include "message_log.hpp"
+#include "message_history.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Precedes the topic and the payload of every message.
+// A record with sequence number zero ends the segment.
+struct message_log::record
+{
+    std::uint64_t seq;
+    std::uint32_t size;
+    std::uint16_t topic_size;
+    std::uint8_t binary;
+    std::uint8_t reserved;
+};
+
+message_log::segment::
+    ~segment()
+{
+    if (data)
+        ::munmap(data, capacity);
+}
+
+message_log::
+    message_log(
+        std::string dir,
+        std::size_t segment_size,
+        std::size_t retention)
+    : dir_(std::move(dir))
+    , segment_size_(std::max<std::size_t>(segment_size, 65536))
+    , retention_(retention)
+{
+    recover();
+    retire();
+    flusher_ = std::thread([this]
+                           { run(); });
+}
+
+message_log::
+    ~message_log()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cv_.notify_one();
+    flusher_.join();
+}
+
+// Records start on 8 byte boundaries
+std::size_t
+message_log::
+    align(std::size_t n) noexcept
+{
+    return (n + 7) & ~std::size_t(7);
+}
+
+std::shared_ptr<message_log::segment>
+message_log::
+    map(std::string path, std::size_t capacity, bool create)
+{
+    int const fd = ::open(
+        path.c_str(), create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0644);
+    if (fd == -1)
+    {
+        std::cerr << "log open " << path << ": " << std::strerror(errno) << "\n";
+        return nullptr;
+    }
+    if (create && ::ftruncate(fd, capacity) != 0)
+    {
+        std::cerr << "log ftruncate " << path << ": " << std::strerror(errno) << "\n";
+        ::close(fd);
+        return nullptr;
+    }
+    auto const p = ::mmap(
+        nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+    {
+        std::cerr << "log mmap " << path << ": " << std::strerror(errno) << "\n";
+        return nullptr;
+    }
+    auto s = std::make_shared<segment>();
+    s->path = std::move(path);
+    s->data = static_cast<unsigned char *>(p);
+    s->capacity = capacity;
+    return s;
+}
+
+// Map the segments left by an earlier run, oldest first
+void message_log::
+    recover()
+{
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    fs::create_directories(dir_, ec);
+
+    std::vector<fs::path> paths;
+    for (auto const &entry : fs::directory_iterator(dir_, ec))
+        if (entry.path().extension() == ".log")
+            paths.push_back(entry.path());
+    std::sort(paths.begin(), paths.end());
+
+    for (auto const &path : paths)
+    {
+        auto const size = fs::file_size(path, ec);
+        if (ec || size < sizeof(record))
+            continue;
+        auto s = map(path.string(), size, false);
+        if (!s)
+            continue;
+        scan(*s);
+        s->flushed = s->size;
+        segments_.push_back(std::move(s));
+    }
+
+    // Never hand out a sequence number already in the log
+    if (!segments_.empty())
+        message_history::skip_sequence(segments_.back()->last);
+}
+
+// Find the end of a segment and rebuild its index
+void message_log::
+    scan(segment &s)
+{
+    while (s.size + sizeof(record) <= s.capacity)
+    {
+        record r;
+        std::memcpy(&r, s.data + s.size, sizeof(r));
+        auto const n = align(sizeof(record) + r.size);
+        if (r.seq == 0 || r.topic_size > r.size || s.size + n > s.capacity)
+            break;
+        add(s, r.seq, n);
+    }
+}
+
+// Account for a record written at the end of a segment
+void message_log::
+    add(segment &s, std::uint64_t seq, std::size_t size)
+{
+    if (s.index.empty() || s.size - s.index.back().second >= index_interval)
+        s.index.emplace_back(s.last, s.size);
+    s.size += size;
+    s.last = std::max(s.last, seq);
+}
+
+void message_log::
+    append(message const &msg)
+{
+    auto const body = msg.payload();
+    auto const &topic = msg.topic();
+    if (topic.size() > 0xffff || body.size() > 0xffffffff - topic.size())
+        return;
+    auto const n = align(sizeof(record) + topic.size() + body.size());
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // Start a new segment when this one is full. The
+    // zeroes after the last record mark where it ends.
+    auto s = segments_.empty() ? nullptr : segments_.back().get();
+    if (!s || s->size + n + sizeof(record) > s->capacity)
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%020llu.log",
+                      static_cast<unsigned long long>(msg.sequence()));
+        auto seg = map(
+            dir_ + "/" + name,
+            std::max(segment_size_, n + sizeof(record)),
+            true);
+        if (!seg)
+            return;
+        s = seg.get();
+        segments_.push_back(std::move(seg));
+        retire();
+    }
+
+    record r{};
+    r.seq = msg.sequence();
+    r.size = static_cast<std::uint32_t>(topic.size() + body.size());
+    r.topic_size = static_cast<std::uint16_t>(topic.size());
+    r.binary = msg.binary() ? 1 : 0;
+    auto const p = s->data + s->size;
+    std::memcpy(p, &r, sizeof(r));
+    std::memcpy(p + sizeof(r), topic.data(), topic.size());
+    std::memcpy(p + sizeof(r) + topic.size(), body.data(), body.size());
+    add(*s, r.seq, n);
+
+    dirty_ += n;
+    if (dirty_ >= flush_bytes)
+        cv_.notify_one();
+}
+
+std::vector<message_ptr>
+message_log::
+    read(
+        std::uint64_t &seq,
+        std::string const &topic,
+        std::size_t limit)
+{
+    // The bytes before a segment's size never change, so they
+    // can be read without holding the mutex. The index grows
+    // with the segment, so the starting offset is found under it.
+    struct range
+    {
+        std::shared_ptr<segment> s;
+        std::size_t offset;
+        std::size_t size;
+    };
+    std::vector<range> v;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto const &s : segments_)
+        {
+            if (s->last <= seq)
+                continue;
+
+            // Skip to the last indexed offset before
+            // which every sequence number is at most seq
+            auto it = std::upper_bound(
+                s->index.begin(), s->index.end(), seq,
+                [](std::uint64_t value, std::pair<std::uint64_t, std::size_t> const &e)
+                {
+                    return value < e.first;
+                });
+            v.push_back({s,
+                         it == s->index.begin() ? 0 : std::prev(it)->second,
+                         s->size});
+        }
+    }
+
+    // The page ends at the limit or after scan_bytes, then
+    // the next one starts after everything looked at
+    std::vector<std::pair<std::uint64_t, message_ptr>> found;
+    std::size_t scanned = 0;
+    std::uint64_t last = seq;
+    bool more = false;
+    for (auto &[s, offset, size] : v)
+    {
+        while (offset < size)
+        {
+            if (found.size() >= limit || scanned >= scan_bytes)
+            {
+                more = true;
+                break;
+            }
+            record r;
+            std::memcpy(&r, s->data + offset, sizeof(r));
+            auto const p = reinterpret_cast<char const *>(s->data + offset + sizeof(r));
+            auto const n = align(sizeof(record) + r.size);
+            offset += n;
+            scanned += n;
+            last = std::max(last, r.seq);
+            if (r.seq <= seq ||
+                topic != beast::string_view(p, r.topic_size))
+                continue;
+            // Only the payload is stored, numbering it again
+            // restores the label
+            auto msg = make_message(
+                net::const_buffer(p + r.topic_size, r.size - r.topic_size),
+                s,
+                topic,
+                r.binary != 0);
+            msg->set_sequence(r.seq);
+            found.emplace_back(r.seq, std::move(msg));
+        }
+        if (more)
+            break;
+    }
+    seq = more ? last : 0;
+
+    // Messages appended by different threads
+    // may be slightly out of order
+    std::sort(found.begin(), found.end(),
+              [](auto const &a, auto const &b)
+              {
+                  return a.first < b.first;
+              });
+    std::vector<message_ptr> result;
+    result.reserve(found.size());
+    for (auto &f : found)
+        result.push_back(std::move(f.second));
+    return result;
+}
+
+void message_log::
+    run()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_)
+    {
+        cv_.wait_for(lock, flush_interval, [this]
+                     { return stop_ || dirty_ >= flush_bytes; });
+        flush(lock);
+    }
+    flush(lock);
+}
+
+// Delete the oldest segments beyond the retention size. A segment
+// stays mapped while a message read from it is alive.
+void message_log::
+    retire()
+{
+    if (retention_ == 0)
+        return;
+    std::size_t total = 0;
+    for (auto const &s : segments_)
+        total += s->capacity;
+    while (total > retention_ && segments_.size() > 1)
+    {
+        auto const &s = segments_.front();
+        if (::unlink(s->path.c_str()) != 0)
+            std::cerr << "log unlink " << s->path << ": " << std::strerror(errno) << "\n";
+        total -= s->capacity;
+        segments_.erase(segments_.begin());
+    }
+}
+
+// Write out the pages appended since the last flush
+void message_log::
+    flush(std::unique_lock<std::mutex> &lock)
+{
+    std::vector<std::pair<std::shared_ptr<segment>, std::size_t>> v;
+    for (auto const &s : segments_)
+        if (s->flushed < s->size)
+            v.emplace_back(s, s->size);
+    dirty_ = 0;
+    if (v.empty())
+        return;
+
+    lock.unlock();
+    auto const page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    for (auto const &[s, size] : v)
+    {
+        auto const from = s->flushed & ~(page - 1);
+        if (::msync(s->data + from, size - from, MS_SYNC) != 0)
+            std::cerr << "log msync " << s->path << ": " << std::strerror(errno) << "\n";
+        s->flushed = size;
+    }
+    lock.lock();
+}
@@ -0,0 +1,123 @@
+#ifndef IR_WEBSOCKET_SERVER_MESSAGE_LOG_HPP
+#define IR_WEBSOCKET_SERVER_MESSAGE_LOG_HPP
+
+#include "message.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/** An append-only log of the broadcasts, kept on disk
+
+    Numbered messages are appended to memory mapped segment files
+    named after the first sequence number they hold. Appending is
+    a copy into the mapping; a background thread writes the pages
+    out, so neither the io_context threads nor the clients ever
+    wait for the disk.
+
+    Each segment keeps a sparse index of positions, so a reader
+    finds where to start without scanning the whole log, and
+    reads it a page at a time. The messages returned by the
+    reader point straight into the mapping. The log is reopened,
+    and appended to, on restart. The oldest segments are deleted
+    once the segments add up to more than the retention size.
+*/
+class message_log
+{
+    struct segment
+    {
+        std::string path;
+        unsigned char *data = nullptr;
+        std::size_t capacity = 0;
+
+        // Bytes appended, protected by the mutex
+        std::size_t size = 0;
+
+        // Bytes written to disk, only used by the flush thread
+        std::size_t flushed = 0;
+
+        // Highest sequence number in the segment
+        std::uint64_t last = 0;
+
+        // Pairs of the highest sequence number before an offset,
+        // and the offset, taken every index_interval bytes
+        std::vector<std::pair<std::uint64_t, std::size_t>> index;
+
+        ~segment();
+    };
+
+    struct record;
+
+    static constexpr std::size_t index_interval = 4096;
+    static constexpr std::size_t scan_bytes = 1024 * 1024;
+    static constexpr std::size_t flush_bytes = 4 * 1024 * 1024;
+    static constexpr std::chrono::milliseconds flush_interval{100};
+
+    std::string dir_;
+    std::size_t segment_size_;
+    std::size_t retention_;
+
+    std::mutex mutex_;
+    std::vector<std::shared_ptr<segment>> segments_;
+    std::size_t dirty_ = 0;
+    bool stop_ = false;
+    std::condition_variable cv_;
+    std::thread flusher_;
+
+    static std::size_t align(std::size_t n) noexcept;
+    std::shared_ptr<segment> map(std::string path, std::size_t capacity, bool create);
+    void recover();
+    void scan(segment &s);
+    void add(segment &s, std::uint64_t seq, std::size_t size);
+    void retire();
+    void run();
+    void flush(std::unique_lock<std::mutex> &lock);
+
+public:
+    /** Constructor
+
+        @param dir The directory holding the segment files.
+
+        @param segment_size The size of a new segment file.
+
+        @param retention The total size of the segments to keep,
+        zero to keep them all.
+    */
+    message_log(
+        std::string dir,
+        std::size_t segment_size,
+        std::size_t retention = 0);
+
+    // Writes out everything appended so far
+    ~message_log();
+
+    // Add a numbered message, may be called from any thread
+    void append(message const &msg);
+
+    /** Read a page of the log back, may be called from any thread
+
+        A page looks at no more than about a megabyte of the log,
+        so that reading one costs little however rare the topic.
+
+        @param seq The sequence number to read after. It is set to
+        where the next page starts, or to zero at the end of the log.
+
+        @return Up to `limit` messages of a topic (or sent to
+        everyone, if the topic is empty) with a sequence number
+        greater than `seq`, in sequence order. Their payloads
+        refer to the mapped segments.
+    */
+    std::vector<message_ptr>
+    read(
+        std::uint64_t &seq,
+        std::string const &topic,
+        std::size_t limit);
+};
+
+#endif
@@ -16,4 +16,11 @@ namespace net = boost::asio;                    // namespace asio
 using tcp = net::ip::tcp;                       // from <boost/asio/ip/tcp.hpp>
 using error_code = boost::system::error_code;   // from <boost/system/error_code.hpp>
 
+// The socket of a connection, whose handlers run on its own strand.
+// Naming the strand in the type, instead of erasing it behind
+// any_io_executor, lets Asio dispatch completions to the strand
+// with the memory of the handler rather than from the heap.
+using session_socket = net::basic_stream_socket<
+    tcp, net::strand<net::io_context::executor_type>>;
+
 #endif
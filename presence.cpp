@@ -0,0 +1,91 @@
+#include "presence.hpp"
+#include "shared_state.hpp"
+
+presence::
+    presence(
+        net::io_context &ioc,
+        shared_state &state,
+        std::chrono::milliseconds window)
+    : state_(state)
+    , window_(window)
+    , timer_(net::make_strand(ioc))
+{
+}
+
+void presence::
+    join(std::uint64_t connection_id)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    joined_.insert(connection_id);
+    schedule();
+}
+
+void presence::
+    leave(std::uint64_t connection_id)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (joined_.erase(connection_id) == 0)
+        left_.push_back(connection_id);
+    schedule();
+}
+
+// Start the window with the first change after a flush.
+// Must be called with the mutex held.
+void presence::
+    schedule()
+{
+    if (pending_)
+        return;
+    pending_ = true;
+    net::post(
+        timer_.get_executor(),
+        [this]
+        {
+            timer_.expires_after(window_);
+            timer_.async_wait(
+                [this](error_code ec)
+                {
+                    if (!ec)
+                        flush();
+                });
+        });
+}
+
+void presence::
+    flush()
+{
+    std::unordered_set<std::uint64_t> joined;
+    std::vector<std::uint64_t> left;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        joined.swap(joined_);
+        left.swap(left_);
+        pending_ = false;
+    }
+    if (joined.empty() && left.empty())
+        return;
+
+    // Connection ids are hexadecimal, so they
+    // can be written out without escaping
+    auto const size = 40 + 19 * (joined.size() + left.size());
+
+    std::string s;
+    s.reserve(size);
+    s += R"({"type":"presence","joined":[)";
+    char const *sep = "";
+    for (auto const id : joined)
+    {
+        s.append(sep).append("\"").append(format_connection_id(id)).append("\"");
+        sep = ",";
+    }
+    s += R"(],"left":[)";
+    sep = "";
+    for (auto const id : left)
+    {
+        s.append(sep).append("\"").append(format_connection_id(id)).append("\"");
+        sep = ",";
+    }
+    s += "]}";
+
+    state_.broadcast(std::move(s), message_priority::high);
+}
@@ -0,0 +1,54 @@
+#ifndef IR_WEBSOCKET_SERVER_PRESENCE_HPP
+#define IR_WEBSOCKET_SERVER_PRESENCE_HPP
+
+#include "net.hpp"
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// Forward declaration
+class shared_state;
+
+/** Batches the joins and leaves of a shard into presence deltas
+
+    Instead of broadcasting every connect and disconnect on its
+    own, which costs O(N) messages per event and O(N^2) when many
+    clients drop at once, the changes are collected for a window
+    and then broadcast as a single message
+
+        {"type":"presence","joined":[<id>...],"left":[<id>...]}
+
+    A connection which joins and leaves within the same window
+    is left out of the delta altogether.
+*/
+class presence
+{
+    shared_state &state_;
+    std::chrono::milliseconds window_;
+    net::steady_timer timer_;
+
+    std::mutex mutex_;
+    std::unordered_set<std::uint64_t> joined_;
+    std::vector<std::uint64_t> left_;
+
+    // Set while a flush is scheduled
+    bool pending_ = false;
+
+    void schedule();
+    void flush();
+
+public:
+    presence(
+        net::io_context &ioc,
+        shared_state &state,
+        std::chrono::milliseconds window);
+
+    // These may be called from any thread
+    void join(std::uint64_t connection_id);
+    void leave(std::uint64_t connection_id);
+};
+
+#endif
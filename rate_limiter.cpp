@@ -0,0 +1,87 @@
+#include "rate_limiter.hpp"
+#include <algorithm>
+
+rate_limiter::bucket::
+    bucket(double rate)
+    : rate_(rate), tokens_(rate), last_(clock::now())
+{
+}
+
+void rate_limiter::bucket::
+    refill(clock::time_point now)
+{
+    std::chrono::duration<double> const elapsed = now - last_;
+    last_ = now;
+    tokens_ = std::min(rate_, tokens_ + elapsed.count() * rate_);
+}
+
+bool rate_limiter::bucket::
+    has(double n) const noexcept
+{
+    return rate_ == 0 || tokens_ >= n;
+}
+
+void rate_limiter::bucket::
+    take(double n) noexcept
+{
+    if (rate_ != 0)
+        tokens_ -= n;
+}
+
+void rate_limiter::bucket::
+    give(double n) noexcept
+{
+    if (rate_ != 0)
+        tokens_ = std::min(rate_, tokens_ + n);
+}
+
+rate_limiter::clock::duration
+rate_limiter::bucket::
+    debt() const
+{
+    if (rate_ == 0 || tokens_ >= 0)
+        return clock::duration::zero();
+    return std::chrono::duration_cast<clock::duration>(
+        std::chrono::duration<double>(-tokens_ / rate_));
+}
+
+rate_limiter::
+    rate_limiter(double messages_per_second, double bytes_per_second)
+    : messages_(messages_per_second), bytes_(bytes_per_second)
+{
+}
+
+bool rate_limiter::
+    try_acquire(std::size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto const now = clock::now();
+    messages_.refill(now);
+    bytes_.refill(now);
+    if (!messages_.has(1) || !bytes_.has(static_cast<double>(bytes)))
+        return false;
+    messages_.take(1);
+    bytes_.take(static_cast<double>(bytes));
+    return true;
+}
+
+void rate_limiter::
+    release(std::size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    messages_.give(1);
+    bytes_.give(static_cast<double>(bytes));
+}
+
+rate_limiter::clock::duration
+rate_limiter::
+    acquire(std::size_t bytes, std::size_t messages)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto const now = clock::now();
+    messages_.refill(now);
+    bytes_.refill(now);
+    messages_.take(static_cast<double>(messages));
+    bytes_.take(static_cast<double>(bytes));
+    return std::max(messages_.debt(), bytes_.debt());
+}
@@ -0,0 +1,56 @@
+#ifndef IR_WEBSOCKET_SERVER_RATE_LIMITER_HPP
+#define IR_WEBSOCKET_SERVER_RATE_LIMITER_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+
+/** Token-bucket limits on messages per second and bytes per second
+
+    Each bucket holds up to one second worth of tokens, which is
+    the largest burst allowed. A rate of zero means no limit. A
+    limiter may be shared by all the sessions of one JWT subject,
+    so its members are protected by a mutex.
+*/
+class rate_limiter
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+private:
+    class bucket
+    {
+        double rate_;
+        double tokens_;
+        clock::time_point last_;
+
+    public:
+        explicit bucket(double rate);
+        void refill(clock::time_point now);
+        bool has(double n) const noexcept;
+        void take(double n) noexcept;
+        void give(double n) noexcept;
+        clock::duration debt() const;
+    };
+
+    std::mutex mutex_;
+    bucket messages_;
+    bucket bytes_;
+
+public:
+    rate_limiter(double messages_per_second, double bytes_per_second);
+
+    // Take the tokens for a message if there are enough,
+    // otherwise leave the buckets alone and return false
+    bool try_acquire(std::size_t bytes);
+
+    // Put back the tokens taken by a successful try_acquire
+    void release(std::size_t bytes);
+
+    // Always take the tokens for a message, going into debt if
+    // needed. Returns how long to wait until the debt is repaid.
+    // A piece of a streamed message passes zero messages.
+    clock::duration acquire(std::size_t bytes, std::size_t messages = 1);
+};
+
+#endif
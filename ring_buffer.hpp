@@ -0,0 +1,124 @@
+#ifndef IR_WEBSOCKET_SERVER_RING_BUFFER_HPP
+#define IR_WEBSOCKET_SERVER_RING_BUFFER_HPP
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/** A double-ended queue stored in one contiguous ring
+
+    Pushing and popping at either end is O(1) and never
+    allocates while the size stays within the capacity.
+    The capacity is a power of two and only grows, by
+    doubling, if an element is pushed into a full ring.
+*/
+template <class T>
+class ring_buffer
+{
+    std::vector<T> slots_;
+    std::size_t head_ = 0;
+    std::size_t size_ = 0;
+
+    std::size_t
+    index(std::size_t i) const noexcept
+    {
+        return (head_ + i) & (slots_.size() - 1);
+    }
+
+    void
+    grow()
+    {
+        std::vector<T> v(slots_.size() * 2);
+        for (std::size_t i = 0; i < size_; ++i)
+            v[i] = std::move(slots_[index(i)]);
+        slots_ = std::move(v);
+        head_ = 0;
+    }
+
+public:
+    explicit ring_buffer(std::size_t capacity = 16)
+    {
+        std::size_t n = 2;
+        while (n < capacity)
+            n <<= 1;
+        slots_.resize(n);
+    }
+
+    std::size_t
+    size() const noexcept
+    {
+        return size_;
+    }
+
+    bool
+    empty() const noexcept
+    {
+        return size_ == 0;
+    }
+
+    std::size_t
+    capacity() const noexcept
+    {
+        return slots_.size();
+    }
+
+    T &
+    operator[](std::size_t i) noexcept
+    {
+        return slots_[index(i)];
+    }
+
+    T const &
+    operator[](std::size_t i) const noexcept
+    {
+        return slots_[index(i)];
+    }
+
+    T &
+    front() noexcept
+    {
+        return slots_[head_];
+    }
+
+    T &
+    back() noexcept
+    {
+        return (*this)[size_ - 1];
+    }
+
+    void
+    push_back(T value)
+    {
+        if (size_ == slots_.size())
+            grow();
+        slots_[index(size_)] = std::move(value);
+        ++size_;
+    }
+
+    void
+    pop_front()
+    {
+        slots_[head_] = T{};
+        head_ = index(1);
+        --size_;
+    }
+
+    void
+    pop_back()
+    {
+        --size_;
+        slots_[index(size_)] = T{};
+    }
+
+    // Remove the element at position i by shifting the
+    // elements in front of it, costs O(i)
+    void
+    erase(std::size_t i)
+    {
+        for (; i > 0; --i)
+            (*this)[i] = std::move((*this)[i - 1]);
+        pop_front();
+    }
+};
+
+#endif
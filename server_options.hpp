@@ -0,0 +1,148 @@
+#ifndef IR_WEBSOCKET_SERVER_SERVER_OPTIONS_HPP
+#define IR_WEBSOCKET_SERVER_SERVER_OPTIONS_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// What a session does when its outgoing queue is full
+enum class slow_consumer_policy
+{
+    // Discard the oldest message not yet being written
+    drop_oldest,
+
+    // Discard the message which did not fit
+    drop_newest,
+
+    // Close the connection with code 1008 (policy violation)
+    disconnect
+};
+
+// What a session does with a message over its rate limit
+enum class rate_limit_policy
+{
+    // Hold the message and stop reading until the bucket
+    // refills, pushing back on the client through TCP
+    delay,
+
+    // Discard the message and keep reading
+    drop
+};
+
+// Settings chosen on the command line which
+// control how the server runs
+struct server_options
+{
+    // Number of threads running the io_context(s)
+    int threads = 1;
+
+    // Give every thread its own io_context and its
+    // own listening socket bound with SO_REUSEPORT
+    bool reuse_port = false;
+
+    // Give every thread its own shard of the server state
+    bool shared_nothing = false;
+
+    // Serialize each broadcast frame once and write the
+    // same bytes to every recipient's socket
+    bool preframed = false;
+
+    // Negotiate the permessage-deflate extension. Together with
+    // preframed, each broadcast is compressed once and sessions
+    // are asked for "server_no_context_takeover".
+    bool deflate = false;
+    int deflate_level = 8;
+    int deflate_mem_level = 4;
+
+    // Limits on each session's outgoing queue, zero for no limit
+    std::size_t queue_limit = 0;
+    std::size_t queue_limit_bytes = 0;
+    slow_consumer_policy slow_consumer = slow_consumer_policy::drop_oldest;
+
+    // When a session's queue is backed up, write up to this many
+    // queued messages as frames in one gathered write. Zero or
+    // one writes each message with its own operation.
+    std::size_t coalesce = 0;
+
+    // Messages published to these topics go ahead of the normal
+    // traffic in every session's queue, like control messages
+    std::vector<std::string> priority_topics;
+
+    // Latency budget in microseconds during which the broadcasts
+    // of a busy shard are collected and sent together, zero to
+    // send every broadcast on its own
+    std::size_t batch_window = 0;
+
+    // Number of recent broadcasts kept for each topic (and for
+    // the messages sent to everyone) so reconnecting clients can
+    // catch up. Zero disables the history.
+    std::size_t history = 0;
+
+    // Number of topics whose broadcasts are kept, the least
+    // recently published topic being forgotten first. Zero
+    // keeps only the messages sent to everyone.
+    std::size_t history_topics = 1024;
+
+    // The most messages one /replay resends. They are read and
+    // queued a page at a time, as the session's queues drain.
+    std::size_t replay_limit = 1024;
+
+    // Limits on inbound messages per second and bytes per second,
+    // for each session and for all the sessions of one JWT subject.
+    // Zero means no limit.
+    double rate_limit = 0;
+    double rate_limit_bytes = 0;
+    double subject_rate_limit = 0;
+    double subject_rate_limit_bytes = 0;
+    rate_limit_policy rate_policy = rate_limit_policy::delay;
+
+    // Tell the sessions who joined and left, batching the changes
+    // of each shard over a window of this many milliseconds
+    bool presence = true;
+    std::size_t presence_window = 100;
+
+    // The Unix domain socket this process listens on for its
+    // siblings, and the sockets of the siblings. Broadcasts are
+    // relayed to every sibling when the path is not empty.
+    std::string bus_path;
+    std::vector<std::string> bus_peers;
+
+    // The name of a broadcast ring in /dev/shm shared with the
+    // sibling processes, and its size when this process creates
+    // it. Broadcasts go through the ring when the name is set.
+    std::string shm_name;
+    std::size_t shm_size = 64 * 1024 * 1024;
+
+    // A directory to log every numbered broadcast to, the size
+    // of each segment file, and the total size of the segments
+    // kept, zero to keep them all. Replays are then served from
+    // the log instead of the in-memory history.
+    std::string log_dir;
+    std::size_t log_segment_size = 64 * 1024 * 1024;
+    std::size_t log_retention = 1024 * 1024 * 1024;
+
+    // The largest message a session accepts, zero for the
+    // websocket stream's default of 16 MiB
+    std::size_t read_message_max = 0;
+
+    // Relay a message larger than this many bytes piece by piece
+    // as it is read, zero to read every message whole. At most
+    // stream_memory bytes of a session's streamed messages are
+    // held by the recipients before the session stops reading.
+    std::size_t stream_chunk = 0;
+    std::size_t stream_memory = 4 * 1024 * 1024;
+
+    // Milliseconds a session may take to send the next piece of
+    // a streamed message, whose recipients write nothing else in
+    // the meantime, and milliseconds the whole message may take.
+    // The message is then ended and the session closed. Zero
+    // waits forever.
+    std::size_t stream_timeout = 5000;
+    std::size_t stream_deadline = 60000;
+
+    // Bytes of finished sessions' objects and read buffers each
+    // thread keeps for the next sessions, zero to keep none
+    std::size_t pool_memory = 8 * 1024 * 1024;
+};
+
+#endif
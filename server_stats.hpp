@@ -0,0 +1,36 @@
+#ifndef IR_WEBSOCKET_SERVER_SERVER_STATS_HPP
+#define IR_WEBSOCKET_SERVER_SERVER_STATS_HPP
+
+#include <atomic>
+#include <cstdint>
+
+// Counters reported by the /api/stats endpoint. They may be
+// updated from any thread, so every counter is atomic.
+struct server_stats
+{
+    using counter = std::atomic<std::uint64_t>;
+
+    // Messages discarded by the slow-consumer policies
+    counter dropped_oldest{0};
+    counter dropped_newest{0};
+    counter dropped_on_disconnect{0};
+
+    // Sessions closed with 1008 for falling too far behind
+    counter slow_consumer_disconnects{0};
+
+    // Streamed messages ended for being late, or for holding
+    // up a recipient whose queues filled in the meantime
+    counter streams_aborted{0};
+
+    // Inbound messages over a rate limit
+    counter rate_limited_delayed{0};
+    counter rate_limited_dropped{0};
+
+    // Broadcasts not sent to a sibling process which fell behind
+    counter bus_dropped{0};
+
+    // Broadcasts which did not fit in the shared memory ring
+    counter shm_dropped{0};
+};
+
+#endif
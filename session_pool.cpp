@@ -0,0 +1,101 @@
+#include "session_pool.hpp"
+#include <new>
+
+session_pool::
+    ~session_pool()
+{
+    for (auto &list : lists_)
+    {
+        while (list.head)
+        {
+            auto const b = list.head;
+            list.head = b->next;
+            ::operator delete(b);
+        }
+    }
+}
+
+session_pool &
+session_pool::
+    local()
+{
+    thread_local session_pool pool;
+    return pool;
+}
+
+void *
+session_pool::
+    allocate(std::size_t size)
+{
+    for (auto &list : lists_)
+    {
+        if (list.size != size || !list.head)
+            continue;
+        auto const b = list.head;
+        list.head = b->next;
+        retained_ -= size;
+        return b;
+    }
+    return ::operator new(size);
+}
+
+void session_pool::
+    deallocate(void *p, std::size_t size, std::size_t limit) noexcept
+{
+    if (retained_ + size > limit || size < sizeof(block))
+        return ::operator delete(p);
+
+    // Find or make the list for this size. Making it may
+    // fail to allocate, then the block is simply freed.
+    free_list *list = nullptr;
+    for (auto &l : lists_)
+        if (l.size == size)
+            list = &l;
+    if (!list)
+    {
+        try
+        {
+            lists_.push_back({size, nullptr});
+        }
+        catch (std::bad_alloc const &)
+        {
+            return ::operator delete(p);
+        }
+        list = &lists_.back();
+    }
+
+    auto const b = static_cast<block *>(p);
+    b->next = list->head;
+    list->head = b;
+    retained_ += size;
+}
+
+beast::flat_buffer
+session_pool::
+    take_buffer()
+{
+    if (buffers_.empty())
+        return {};
+    auto b = std::move(buffers_.back());
+    buffers_.pop_back();
+    retained_ -= b.capacity();
+    return b;
+}
+
+void session_pool::
+    give_back(beast::flat_buffer &&b, std::size_t limit) noexcept
+{
+    auto const size = b.capacity();
+    if (size == 0 || retained_ + size > limit)
+        return;
+    try
+    {
+        buffers_.push_back(std::move(b));
+    }
+    catch (std::bad_alloc const &)
+    {
+        return;
+    }
+    buffers_.back().clear();
+    retained_ += size;
+}
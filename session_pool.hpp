@@ -0,0 +1,124 @@
+#ifndef IR_WEBSOCKET_SERVER_SESSION_POOL_HPP
+#define IR_WEBSOCKET_SERVER_SESSION_POOL_HPP
+
+#include "beast.hpp"
+#include <cstddef>
+#include <vector>
+
+/** Per-thread free lists of session memory
+
+    Every accepted connection creates an http_session and, for a
+    websocket upgrade, a websocket_session, each with a read buffer
+    grown to fit the client's messages. When clients reconnect by
+    the thousands, allocating and freeing all of that makes the
+    heap a hot spot shared by every thread.
+
+    Instead, a finished session gives its memory back to the pool
+    of the thread destroying it: the block holding the session
+    object and its shared_ptr control block, and its read buffer,
+    which keeps the capacity it grew to. The next session created
+    on that thread takes them again without touching the heap.
+
+    Each thread retains at most a given number of bytes, counting
+    the blocks and the capacity of the buffers. Memory given back
+    beyond that goes to the heap.
+*/
+class session_pool
+{
+    struct block
+    {
+        block *next;
+    };
+
+    // Free blocks of one size, one list for each session type
+    struct free_list
+    {
+        std::size_t size;
+        block *head;
+    };
+
+    std::vector<free_list> lists_;
+    std::vector<beast::flat_buffer> buffers_;
+    std::size_t retained_ = 0;
+
+    session_pool() = default;
+    ~session_pool();
+
+public:
+    session_pool(session_pool const &) = delete;
+    session_pool &operator=(session_pool const &) = delete;
+
+    // Returns the pool of the calling thread
+    static session_pool &local();
+
+    void *allocate(std::size_t size);
+    void deallocate(void *p, std::size_t size, std::size_t limit) noexcept;
+
+    // Returns a recycled buffer, or an empty one
+    beast::flat_buffer take_buffer();
+
+    // Keep an emptied buffer for the next session
+    void give_back(beast::flat_buffer &&b, std::size_t limit) noexcept;
+};
+
+/** Allocates sessions from the pool of the calling thread
+
+    Pass it to std::allocate_shared, so that the session
+    and its control block share one recycled block.
+*/
+template <class T>
+class session_allocator
+{
+    template <class>
+    friend class session_allocator;
+
+    std::size_t limit_;
+
+public:
+    using value_type = T;
+
+    // At most `limit` bytes are kept per thread, zero for none
+    explicit session_allocator(std::size_t limit) noexcept
+        : limit_(limit)
+    {
+    }
+
+    template <class U>
+    session_allocator(session_allocator<U> const &other) noexcept
+        : limit_(other.limit_)
+    {
+    }
+
+    T *
+    allocate(std::size_t n)
+    {
+        return static_cast<T *>(
+            session_pool::local().allocate(sizeof(T) * n));
+    }
+
+    void
+    deallocate(T *p, std::size_t n) noexcept
+    {
+        session_pool::local().deallocate(p, sizeof(T) * n, limit_);
+    }
+
+    template <class U>
+    friend bool
+    operator==(
+        session_allocator const &,
+        session_allocator<U> const &) noexcept
+    {
+        return true;
+    }
+
+    template <class U>
+    friend bool
+    operator!=(
+        session_allocator const &,
+        session_allocator<U> const &) noexcept
+    {
+        return false;
+    }
+};
+
+#endif
@@ -8,62 +8,497 @@
 //
 
 #include "shared_state.hpp"
+#include "engine.hpp"
+#include "local_bus.hpp"
+#include "message_log.hpp"
+#include "shm_ring.hpp"
 #include "websocket_session.hpp"
+#include <algorithm>
+#include <random>
 
 shared_state::
-    shared_state(std::string doc_root)
-    : doc_root_(std::move(doc_root))
+    shared_state(
+        std::string doc_root,
+        server_options const &options)
+    : doc_root_(std::move(doc_root)), options_(options)
+    , sessions_(
+          (static_cast<std::uint64_t>(std::random_device{}()) << 32) ^
+          std::random_device{}())
 {
+    if (options_.history > 0)
+        history_ = std::make_unique<message_history>(
+            options_.history, options_.history_topics);
 }
 
 void shared_state::
-    connect(const std::string &connection_id, websocket_session *session)
+    start(net::io_context &ioc)
 {
-    sessions_[connection_id] = session;
-    send(connection_id, "you connected as :" + connection_id);
+    if (options_.presence)
+        presence_ = std::make_unique<presence>(
+            ioc,
+            *this,
+            std::chrono::milliseconds(options_.presence_window));
+    if (options_.batch_window != 0)
+        batcher_ = std::make_unique<batcher>(
+            ioc,
+            *this,
+            std::chrono::microseconds(options_.batch_window));
 }
 
-void shared_state::
-    disconnect(const std::string &connection_id)
+std::uint64_t shared_state::
+    connect(websocket_session *session)
 {
-    if (connection_id != "")
+    std::uint64_t connection_id;
     {
-        sessions_.erase(connection_id);
-        boost::beast::flat_buffer buff;
-        std::string myString = "a client disconnected :" + connection_id;
-        boost::beast::ostream(buff) << myString;
-        broadcast(beast::buffers_to_string(buff.data()));
+        std::lock_guard<std::mutex> lock(mutex_);
+        connection_id = sessions_.insert(
+            {session, session->weak_from_this(), {}}) |
+            (static_cast<std::uint64_t>(shard_) << 56);
     }
+    send(connection_id,
+         "you connected as :" + format_connection_id(connection_id),
+         message_priority::high);
+    if (presence_)
+        presence_->join(connection_id);
+    return connection_id;
 }
 
 void shared_state::
-    send(const std::string &connection_id, const std::string &message)
+    disconnect(std::uint64_t connection_id)
+{
+    if (connection_id != 0)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto const c = sessions_.find(connection_id);
+            if (!c)
+                return;
+
+            // Leave every topic the session subscribed to
+            for (auto const &topic : c->topics)
+                remove_subscriber(topic, c->session);
+            sessions_.erase(connection_id);
+        }
+        if (presence_)
+            presence_->leave(connection_id);
+    }
+}
+
+bool shared_state::
+    send(
+        std::uint64_t connection_id,
+        std::string payload,
+        message_priority priority)
 {
+    auto msg = make_message(std::move(payload));
+    msg->set_priority(priority);
+    return send(connection_id, std::move(msg));
+}
+
+bool shared_state::
+    send(std::uint64_t connection_id, message_ptr msg)
+{
+    auto const shard = static_cast<std::size_t>(connection_id >> 56);
+    if (engine_ && shard != shard_)
+    {
+        if (shard >= engine_->size())
+            return false;
+        engine_->send(shard, connection_id, std::move(msg));
+        return true;
+    }
     auto const session = get(connection_id);
-    if (session != nullptr)
+    if (session)
+    {
+        session->send(std::move(msg));
+        return true;
+    }
+    return false;
+}
+
+void shared_state::
+    broadcast(std::string payload, message_priority priority)
+{
+    auto msg = make_message(std::move(payload));
+    msg->set_priority(priority);
+    broadcast(prepare(std::move(msg)));
+}
+
+void shared_state::
+    broadcast(beast::flat_buffer body, bool binary)
+{
+    auto msg = make_message(std::move(body), std::string(), binary);
+    msg->recycle(options_.pool_memory);
+    broadcast(prepare(std::move(msg)));
+}
+
+void shared_state::
+    publish(std::string topic, std::string payload)
+{
+    if (!topic.empty())
+        broadcast(prepare(make_message(
+            std::move(payload), std::move(topic))));
+}
+
+void shared_state::
+    publish(std::string topic, beast::flat_buffer body, bool binary)
+{
+    if (topic.empty())
+        return;
+    auto msg = make_message(std::move(body), std::move(topic), binary);
+    msg->recycle(options_.pool_memory);
+    broadcast(prepare(std::move(msg)));
+}
+
+// Finish building a message before it is shared
+message_ptr shared_state::
+    prepare(mutable_message_ptr msg, bool number)
+{
+    // With a history or a log, every message is numbered so
+    // a client knows where to resume after reconnecting
+    if ((history_ || log_) && number)
+        msg->set_sequence(message_history::next_sequence());
+
+    auto const &topics = options_.priority_topics;
+    if (!msg->topic().empty() &&
+        std::find(topics.begin(), topics.end(), msg->topic()) != topics.end())
+        msg->set_priority(message_priority::high);
+
+    if (options_.preframed)
+    {
+        msg->make_frame();
+        if (options_.deflate)
+            msg->make_deflated_frames(
+                options_.deflate_level,
+                options_.deflate_mem_level);
+    }
+    return msg;
+}
+
+std::vector<message_ptr> shared_state::
+    replay(
+        std::uint64_t &seq,
+        const std::string &topic,
+        std::size_t limit)
+{
+    // The log reaches further back than the history
+    if (log_)
+        return log_->read(seq, topic, limit);
+    if (!history_)
+    {
+        seq = 0;
+        return {};
+    }
+    auto v = history_->since(seq, topic);
+    if (v.size() > limit)
+    {
+        v.resize(limit);
+        seq = v.back()->sequence();
+    }
+    else
+    {
+        seq = 0;
+    }
+    return v;
+}
+
+std::shared_ptr<rate_limiter> shared_state::
+    subject_limiter(const std::string &subject)
+{
+    if (subject.empty() ||
+        (options_.subject_rate_limit == 0 &&
+         options_.subject_rate_limit_bytes == 0))
+        return nullptr;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto &wp = limiters_[subject];
+    auto sp = wp.lock();
+    if (sp)
+        return sp;
+    sp = std::make_shared<rate_limiter>(
+        options_.subject_rate_limit,
+        options_.subject_rate_limit_bytes);
+    wp = sp;
+
+    // Forget the subjects which have no sessions left
+    // whenever the table has doubled in size
+    if (limiters_.size() >= limiters_sweep_)
+    {
+        for (auto it = limiters_.begin(); it != limiters_.end();)
+        {
+            if (it->second.expired())
+                it = limiters_.erase(it);
+            else
+                ++it;
+        }
+        limiters_sweep_ = std::max<std::size_t>(64, 2 * limiters_.size());
+    }
+    return sp;
+}
+
+void shared_state::
+    subscribe(std::uint64_t connection_id, const std::string &topic)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto const c = sessions_.find(connection_id);
+    if (!c || topic.empty())
+        return;
+    auto &topics = c->topics;
+    if (std::find(topics.begin(), topics.end(), topic) != topics.end())
+        return;
+    topics.push_back(topic);
+    topics_[topic].push_back(c->session);
+}
+
+void shared_state::
+    unsubscribe(std::uint64_t connection_id, const std::string &topic)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto const c = sessions_.find(connection_id);
+    if (!c)
+        return;
+    auto &topics = c->topics;
+    auto const pos = std::find(topics.begin(), topics.end(), topic);
+    if (pos == topics.end())
+        return;
+    topics.erase(pos);
+    remove_subscriber(topic, c->session);
+}
+
+// Must be called with the mutex held
+void shared_state::
+    remove_subscriber(const std::string &topic, websocket_session *session)
+{
+    auto const it = topics_.find(topic);
+    if (it == topics_.end())
+        return;
+
+    // Order does not matter, so swap with the last and pop
+    auto &v = it->second;
+    auto const pos = std::find(v.begin(), v.end(), session);
+    if (pos != v.end())
     {
-        auto const ss = std::make_shared<std::string const>(std::move(message));
-        session->send(ss);
+        *pos = v.back();
+        v.pop_back();
     }
+    if (v.empty())
+        topics_.erase(it);
 }
 
 void shared_state::
-    broadcast(const std::string &message)
+    broadcast(message_ptr const &msg)
 {
-    for (const auto &entry : sessions_)
+    if (log_ && msg->sequence() != 0)
+        log_->append(*msg);
+
+    deliver(msg);
+
+    // Let the other shards fan the message out to their sessions
+    if (engine_)
+        engine_->forward(shard_, msg);
+
+    // And the sibling processes to theirs
+    if (bus_)
+        bus_->publish(msg);
+    if (shm_ && !shm_->publish(*msg))
+        ++stats_.shm_dropped;
+}
+
+void shared_state::
+    stream(message_ptr const &msg)
+{
+    deliver(msg);
+    if (engine_)
+        engine_->forward(shard_, msg);
+}
+
+void shared_state::
+    receive(mutable_message_ptr msg)
+{
+    // The sibling's label arrived as part of the payload.
+    // Having no number here, it is not kept in our history.
+    auto const m = prepare(std::move(msg), false);
+    deliver(m);
+    if (engine_)
+        engine_->forward(shard_, m);
+}
+
+void shared_state::
+    deliver(message_ptr const &msg)
+{
+    if (history_ && msg->sequence() != 0)
+        history_->record(msg);
+
+    // Under load, wait for the rest of the batch
+    if (batcher_ && batcher_->add(msg))
+        return;
+
+    // For each session in our local list, try to acquire a strong
+    // pointer. If successful, then send the message on that session.
+    auto v = std::move(scratch());
+    if (msg->topic().empty())
+        snapshot(v);
+    else
+        snapshot(msg->topic(), v);
+    for (const auto &wp : v)
+        if (auto session = wp.lock())
+            session->send(msg);
+    v.clear();
+    scratch() = std::move(v);
+}
+
+void shared_state::
+    deliver(std::vector<message_ptr> const &batch)
+{
+    // Messages to everyone are shared by all the sessions
+    if (std::all_of(batch.begin(), batch.end(),
+                    [](message_ptr const &msg)
+                    {
+                        return msg->topic().empty();
+                    }))
     {
-        websocket_session *session = entry.second;
-        if (session != nullptr)
+        auto const shared = std::make_shared<std::vector<message_ptr> const>(batch);
+        auto v = std::move(scratch());
+        snapshot(v);
+        for (auto const &wp : v)
+            if (auto session = wp.lock())
+                session->send(shared);
+        v.clear();
+        scratch() = std::move(v);
+        return;
+    }
+
+    // Otherwise gather the messages of each recipient, in order
+    std::vector<std::pair<
+        std::weak_ptr<websocket_session>,
+        std::vector<message_ptr>>> v;
+    {
+        std::unordered_map<websocket_session *, std::size_t> index;
+        auto const add = [&](websocket_session *session, message_ptr const &msg)
+        {
+            auto const result = index.try_emplace(session, v.size());
+            if (result.second)
+                v.emplace_back(session->weak_from_this(), std::vector<message_ptr>());
+            v[result.first->second].second.push_back(msg);
+        };
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto const &msg : batch)
         {
-            auto const ss = std::make_shared<std::string const>(std::move(message));
-            session->send(ss);
+            if (msg->topic().empty())
+            {
+                for (auto const &c : sessions_)
+                    add(c.session, msg);
+                continue;
+            }
+            auto const it = topics_.find(msg->topic());
+            if (it != topics_.end())
+                for (auto const session : it->second)
+                    add(session, msg);
         }
     }
+    for (auto &entry : v)
+        if (auto session = entry.first.lock())
+            session->send(std::make_shared<std::vector<message_ptr> const>(
+                std::move(entry.second)));
+}
+
+void shared_state::
+    attach(engine *e, std::size_t shard) noexcept
+{
+    engine_ = e;
+    shard_ = shard;
 }
 
-websocket_session *shared_state::
-    get(const std::string &connection_id)
+void shared_state::
+    attach(local_bus *bus) noexcept
 {
-    auto it = sessions_.find(connection_id);
-    return (it != sessions_.end()) ? it->second : nullptr;
+    bus_ = bus;
+}
+
+void shared_state::
+    attach(shm_ring *shm) noexcept
+{
+    shm_ = shm;
+}
+
+void shared_state::
+    attach(message_log *log) noexcept
+{
+    log_ = log;
+}
+
+// Each thread keeps its list of recipients between broadcasts,
+// so that its capacity is reused. A delivery takes the list and
+// puts it back, one made during another gets a new list.
+std::vector<std::weak_ptr<websocket_session>> &
+shared_state::
+    scratch()
+{
+    thread_local std::vector<std::weak_ptr<websocket_session>> v;
+    return v;
+}
+
+void shared_state::
+    snapshot(std::vector<std::weak_ptr<websocket_session>> &v)
+{
+    // Make a local list of all the weak pointers representing
+    // the sessions, so we can do the actual sending without
+    // holding the mutex:
+    std::lock_guard<std::mutex> lock(mutex_);
+    v.reserve(sessions_.size());
+    for (auto const &c : sessions_)
+        v.push_back(c.weak);
+}
+
+void shared_state::
+    snapshot(
+        const std::string &topic,
+        std::vector<std::weak_ptr<websocket_session>> &v)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto const it = topics_.find(topic);
+    if (it == topics_.end())
+        return;
+    v.reserve(it->second.size());
+    for (auto const session : it->second)
+        v.emplace_back(session->weak_from_this());
+}
+
+std::shared_ptr<websocket_session> shared_state::
+    get(std::uint64_t connection_id)
+{
+    // A session whose destructor is already running
+    // yields an empty pointer here.
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto const c = sessions_.find(connection_id);
+    return c ? c->weak.lock() : nullptr;
+}
+
+std::string
+format_connection_id(std::uint64_t id)
+{
+    static char const digits[] = "0123456789abcdef";
+    std::string s(16, '0');
+    for (auto i = s.rbegin(); i != s.rend(); ++i, id >>= 4)
+        *i = digits[id & 15];
+    return s;
+}
+
+std::uint64_t
+parse_connection_id(beast::string_view s) noexcept
+{
+    if (s.size() != 16)
+        return 0;
+    std::uint64_t id = 0;
+    for (auto const c : s)
+    {
+        id <<= 4;
+        if (c >= '0' && c <= '9')
+            id |= static_cast<std::uint64_t>(c - '0');
+        else if (c >= 'a' && c <= 'f')
+            id |= static_cast<std::uint64_t>(c - 'a' + 10);
+        else
+            return 0;
+    }
+    return id;
 }
@@ -10,25 +10,94 @@
 #ifndef IR_WEBSOCKET_SERVER_SHARED_STATE_HPP
 #define IR_WEBSOCKET_SERVER_SHARED_STATE_HPP
 
+#include "batcher.hpp"
+#include "beast.hpp"
+#include "message.hpp"
+#include "message_history.hpp"
+#include "net.hpp"
+#include "presence.hpp"
+#include "rate_limiter.hpp"
+#include "server_options.hpp"
+#include "server_stats.hpp"
+#include "slot_map.hpp"
+#include <cstdint>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
-// Forward declaration
+// Forward declarations
+class engine;
+class local_bus;
+class message_log;
+class shm_ring;
 class websocket_session;
 
 // Represents the shared server state
 class shared_state
 {
     std::string doc_root_;
+    server_options options_;
+    server_stats stats_;
+    std::unique_ptr<message_history> history_;
+    std::unique_ptr<presence> presence_;
+    std::unique_ptr<batcher> batcher_;
 
-    // This simple method of tracking
-    // sessions only works with an implicit
-    // strand (i.e. a single-threaded server)
-    std::unordered_map<std::string, websocket_session *> sessions_;
+    // This mutex synchronizes all access to sessions_,
+    // which may be touched from any thread running
+    // the io_context. Sessions are only sent to after
+    // the lock is released.
+    std::mutex mutex_;
+
+    // A session with the topics it subscribed to, used to
+    // unsubscribe on disconnect. The weak pointer is kept next
+    // to the others so a broadcast copies them in one pass over
+    // contiguous memory, without touching the sessions.
+    struct connection
+    {
+        websocket_session *session = nullptr;
+        std::weak_ptr<websocket_session> weak;
+        std::vector<std::string> topics;
+    };
+
+    // The connection ids are the ids of this map
+    slot_map<connection> sessions_;
+
+    // Subscribers of each topic, kept in a dense list
+    // so a publish only touches the topic's subscribers
+    std::unordered_map<std::string, std::vector<websocket_session *>> topics_;
+
+    // Rate limiters shared by the sessions of each JWT subject
+    std::unordered_map<std::string, std::weak_ptr<rate_limiter>> limiters_;
+    std::size_t limiters_sweep_ = 64;
+
+    // Set when this object is one shard of a shared-nothing
+    // engine, broadcasts are then also handed to the other shards.
+    // The shard is kept in the top 8 bits of its connection ids,
+    // so a direct send can find the shard of its recipient.
+    engine *engine_ = nullptr;
+    std::size_t shard_ = 0;
+
+    // Set when broadcasts are also relayed to sibling processes
+    local_bus *bus_ = nullptr;
+    shm_ring *shm_ = nullptr;
+
+    // Set when numbered broadcasts are written to disk
+    message_log *log_ = nullptr;
+
+    static std::vector<std::weak_ptr<websocket_session>> &scratch();
+    void snapshot(std::vector<std::weak_ptr<websocket_session>> &v);
+    void snapshot(
+        const std::string &topic,
+        std::vector<std::weak_ptr<websocket_session>> &v);
+    message_ptr prepare(mutable_message_ptr msg, bool number = true);
+    void remove_subscriber(const std::string &topic, websocket_session *session);
 
 public:
-    explicit shared_state(std::string doc_root);
+    explicit shared_state(
+        std::string doc_root,
+        server_options const &options = {});
 
     std::string const &
     doc_root() const noexcept
@@ -36,11 +105,103 @@ public:
         return doc_root_;
     }
 
-    void connect(const std::string &connection_id,websocket_session* session);
-    void disconnect(const std::string &connection_id);
-    void send(const std::string &connection_id,const std::string &message);
-    void broadcast(const std::string &message);
-    websocket_session* get(const std::string &connection_id);
+    // Start the presence notifications and the batching of
+    // broadcasts on an io_context, before any session connects
+    void start(net::io_context &ioc);
+
+    server_options const &
+    options() const noexcept
+    {
+        return options_;
+    }
+
+    server_stats &
+    stats() noexcept
+    {
+        return stats_;
+    }
+
+    server_stats const &
+    stats() const noexcept
+    {
+        return stats_;
+    }
+
+    // Add a session, returning its new connection id
+    std::uint64_t connect(websocket_session *session);
+    void disconnect(std::uint64_t connection_id);
+
+    // Send a message to one session. A session of another
+    // shard is reached through the engine, in which case this
+    // returns true without knowing if the session still exists.
+    // Otherwise returns false if there is no such session.
+    bool send(
+        std::uint64_t connection_id,
+        std::string payload,
+        message_priority priority = message_priority::normal);
+    bool send(std::uint64_t connection_id, message_ptr msg);
+
+    // Send a message to every session. The payload is allocated
+    // once and the same immutable buffer is shared by all the
+    // recipients (and by the other shards, if any).
+    // With the preframed option the frame is also serialized once.
+    void broadcast(
+        std::string payload,
+        message_priority priority = message_priority::normal);
+    void broadcast(message_ptr const &msg);
+
+    // Relay a message read by a session, taking over its
+    // read buffer and keeping its opcode
+    void broadcast(beast::flat_buffer body, bool binary);
+
+    // Relay one piece of a message a session is still reading.
+    // The pieces reach the sessions of every shard but are not
+    // numbered, kept, logged or passed to the siblings.
+    void stream(message_ptr const &msg);
+
+    // Send a message to the subscribers of a topic
+    void publish(std::string topic, std::string payload);
+    void publish(std::string topic, beast::flat_buffer body, bool binary);
+
+    // Returns up to `limit` messages of a topic (or those sent
+    // to everyone) after sequence number `seq`, from the log or
+    // the history, setting `seq` to where the next page starts
+    // or to zero when there are no more
+    std::vector<message_ptr> replay(
+        std::uint64_t &seq,
+        const std::string &topic,
+        std::size_t limit);
+
+    // Returns the rate limiter shared by every session of a
+    // JWT subject, or null if subjects are not rate limited
+    std::shared_ptr<rate_limiter> subject_limiter(const std::string &subject);
+
+    void subscribe(std::uint64_t connection_id, const std::string &topic);
+    void unsubscribe(std::uint64_t connection_id, const std::string &topic);
+
+    // Send a message to the sessions of this shard only,
+    // or to the subscribers of its topic if it has one
+    void deliver(message_ptr const &msg);
+
+    // Send a batch of messages, each session receiving
+    // the ones meant for it together
+    void deliver(std::vector<message_ptr> const &batch);
+
+    // Send a message received from a sibling process to the
+    // sessions of every shard, but not back to the siblings
+    void receive(mutable_message_ptr msg);
+
+    void attach(engine *e, std::size_t shard) noexcept;
+    void attach(local_bus *bus) noexcept;
+    void attach(shm_ring *shm) noexcept;
+    void attach(message_log *log) noexcept;
+    std::shared_ptr<websocket_session> get(std::uint64_t connection_id);
 };
 
+// Connection ids are written as 16 hexadecimal digits on the wire
+std::string format_connection_id(std::uint64_t id);
+
+// Returns the id written by format_connection_id, or zero
+std::uint64_t parse_connection_id(beast::string_view s) noexcept;
+
 #endif
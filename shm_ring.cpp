@@ -0,0 +1,473 @@
+#include "shm_ring.hpp"
+#include "shared_state.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <random>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+struct shm_ring::header
+{
+    static constexpr std::uint64_t magic_value = 0x49525348'4d52494eull;
+
+    // Written last by the process which created the file
+    std::atomic<std::uint64_t> magic;
+    std::uint64_t capacity;
+
+    // Mixed into the commit marker of every record, so that stale
+    // payload bytes can not pass for a committed record header
+    std::uint64_t key;
+
+    // The PID namespace of the creator, the pids in the slots
+    // mean nothing to a process in another one
+    std::uint64_t pid_namespace;
+
+    // Position of the next free byte, only ever grows
+    alignas(64) std::atomic<std::uint64_t> tail;
+
+    // The tail when a process was last found dead. Any record it
+    // left uncommitted was reserved before this position.
+    std::atomic<std::uint64_t> reaped_tail;
+
+    // One for each process using the ring
+    struct alignas(64) slot
+    {
+        std::atomic<int> pid;
+        std::atomic<std::uint64_t> cursor;
+    };
+    slot slots[max_slots];
+};
+
+struct shm_ring::record
+{
+    static constexpr std::uint8_t binary = 1;
+    static constexpr std::uint8_t padding = 2;
+    static constexpr std::uint8_t high = 4;
+
+    // (position + 1) ^ key once the record is complete
+    std::atomic<std::uint64_t> marker;
+
+    // Bytes of topic and payload following the record
+    std::uint32_t size;
+    std::uint16_t topic_size;
+    std::uint8_t flags;
+
+    // Slot of the process which appended the record
+    std::uint8_t origin;
+};
+
+// Records start on 16 byte boundaries
+std::uint64_t
+shm_ring::
+    align(std::uint64_t n) noexcept
+{
+    return (n + 15) & ~std::uint64_t(15);
+}
+
+// Returns an identifier of the PID namespace of
+// this process, or zero if it is not known
+std::uint64_t
+shm_ring::
+    pid_namespace() noexcept
+{
+    struct stat st{};
+    if (::stat("/proc/self/ns/pid", &st) != 0)
+        return 0;
+    return static_cast<std::uint64_t>(st.st_ino);
+}
+
+shm_ring::mapping::
+    ~mapping()
+{
+    if (data)
+        ::munmap(data, size);
+}
+
+shm_ring::
+    shm_ring(
+        net::io_context &ioc,
+        std::shared_ptr<shared_state> const &state,
+        std::string const &name,
+        std::size_t size)
+    : state_(state)
+    , timer_(net::make_strand(ioc))
+{
+    // The atomics are shared between processes
+    static_assert(sizeof(record) == 16, "");
+    static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "");
+
+    if (!open("/dev/shm/" + name, size) || !claim_slot())
+        header_ = nullptr;
+}
+
+shm_ring::
+    ~shm_ring()
+{
+    if (header_)
+        header_->slots[slot_].pid.store(0, std::memory_order_release);
+}
+
+void shm_ring::
+    fail(char const *what)
+{
+    std::cerr << what << ": " << std::strerror(errno) << "\n";
+}
+
+bool shm_ring::
+    open(std::string const &path, std::size_t size)
+{
+    capacity_ = 65536;
+    while (capacity_ < size)
+        capacity_ <<= 1;
+
+    // The first process creates and sizes the file
+    std::size_t total = sizeof(header) + capacity_;
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    bool const creator = fd != -1;
+    if (creator)
+    {
+        if (::ftruncate(fd, total) != 0)
+        {
+            fail("shm ftruncate");
+            ::close(fd);
+            return false;
+        }
+    }
+    else
+    {
+        if (errno != EEXIST || (fd = ::open(path.c_str(), O_RDWR)) == -1)
+        {
+            fail("shm open");
+            return false;
+        }
+
+        // Wait for the creator to size it
+        struct stat st{};
+        for (int i = 0; i < 1000; ++i)
+        {
+            if (::fstat(fd, &st) == 0 &&
+                st.st_size > static_cast<off_t>(sizeof(header)))
+                break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        total = static_cast<std::size_t>(st.st_size);
+    }
+
+    auto const p = ::mmap(
+        nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+    {
+        fail("shm mmap");
+        return false;
+    }
+    map_ = std::make_shared<mapping>();
+    map_->data = p;
+    map_->size = total;
+    header_ = static_cast<header *>(p);
+    data_ = static_cast<unsigned char *>(p) + sizeof(header);
+
+    if (creator)
+    {
+        header_->capacity = capacity_;
+        header_->key = std::random_device{}() |
+            (std::uint64_t(std::random_device{}()) << 32);
+        header_->pid_namespace = pid_namespace();
+        header_->magic.store(header::magic_value, std::memory_order_release);
+        return true;
+    }
+
+    // Wait for the creator to initialize it
+    for (int i = 0; i < 1000; ++i)
+    {
+        if (header_->magic.load(std::memory_order_acquire) == header::magic_value)
+        {
+            capacity_ = header_->capacity;
+            if (sizeof(header) + capacity_ != total)
+                break;
+            if (header_->pid_namespace != pid_namespace())
+            {
+                errno = EXDEV;
+                fail("shm pid namespace");
+                return false;
+            }
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    errno = EINVAL;
+    fail("shm header");
+    return false;
+}
+
+bool shm_ring::
+    claim_slot()
+{
+    int const pid = ::getpid();
+    for (std::size_t i = 0; i < max_slots; ++i)
+    {
+        auto &slot = header_->slots[i];
+        int expected = 0;
+        if (!slot.pid.compare_exchange_strong(expected, pid))
+            continue;
+
+        // Start reading at the end, the records
+        // already in the ring are not ours to see
+        slot_ = i;
+        next_ = header_->tail.load(std::memory_order_acquire);
+        slot.cursor.store(next_, std::memory_order_release);
+        last_reap_ = std::chrono::steady_clock::now();
+        return true;
+    }
+    errno = EBUSY;
+    fail("shm slot");
+    return false;
+}
+
+// Free the slots of the processes which exited without closing
+// the ring, since their cursors would hold back every producer
+void shm_ring::
+    reap()
+{
+    auto const now = std::chrono::steady_clock::now();
+    if (now - last_reap_ < std::chrono::seconds(1))
+        return;
+    last_reap_ = now;
+
+    for (std::size_t i = 0; i < max_slots; ++i)
+    {
+        auto &slot = header_->slots[i];
+        int pid = slot.pid.load(std::memory_order_relaxed);
+        if (pid == 0 || i == slot_)
+            continue;
+        if (::kill(pid, 0) != -1 || errno != ESRCH ||
+            !slot.pid.compare_exchange_strong(pid, 0))
+            continue;
+
+        // The process may have died in the middle of an append
+        auto const tail = header_->tail.load(std::memory_order_acquire);
+        auto reaped = header_->reaped_tail.load(std::memory_order_relaxed);
+        while (reaped < tail &&
+               !header_->reaped_tail.compare_exchange_weak(
+                   reaped, tail, std::memory_order_release))
+            ;
+    }
+}
+
+// Returns true if the uncommitted record at next_ may have been
+// left by a process which died, and was waited on long enough
+bool shm_ring::
+    abandoned()
+{
+    auto const now = std::chrono::steady_clock::now();
+    if (stalled_at_ != next_)
+    {
+        stalled_at_ = next_;
+        stalled_since_ = now;
+        return false;
+    }
+    return now - stalled_since_ >= abandon_timeout &&
+           next_ < header_->reaped_tail.load(std::memory_order_acquire);
+}
+
+// Returns the position of the first committed record after next_,
+// or the tail if there is none. A stale marker of an earlier lap
+// does not match the position, so only records of this lap count.
+std::uint64_t
+shm_ring::
+    next_committed(std::uint64_t tail) const noexcept
+{
+    auto const key = header_->key;
+    for (auto pos = next_ + 16; pos < tail; pos += 16)
+    {
+        auto const r = reinterpret_cast<record *>(
+            data_ + (pos & (capacity_ - 1)));
+        if (r->marker.load(std::memory_order_acquire) == ((pos + 1) ^ key))
+            return pos;
+    }
+    return tail;
+}
+
+std::uint64_t
+shm_ring::
+    min_cursor() const noexcept
+{
+    auto result = header_->tail.load(std::memory_order_acquire);
+    for (auto const &slot : header_->slots)
+        if (slot.pid.load(std::memory_order_relaxed) != 0)
+            result = std::min(
+                result, slot.cursor.load(std::memory_order_acquire));
+    return result;
+}
+
+bool shm_ring::
+    publish(message const &msg)
+{
+    if (!header_)
+        return false;
+
+    // The siblings get the label too, they deliver the same bytes
+    auto const body = msg.data();
+    auto const &topic = msg.topic();
+    if (topic.size() > 0xffff)
+        return false;
+    auto const size = align(sizeof(record) + topic.size() + msg.size());
+    if (size > capacity_ / 2)
+        return false;
+
+    // Reserve the space. A record never wraps around the end of
+    // the ring, the rest of the ring is skipped with a padding
+    // record instead.
+    auto t = header_->tail.load(std::memory_order_relaxed);
+    std::uint64_t offset;
+    std::uint64_t pad;
+    for (;;)
+    {
+        offset = t & (capacity_ - 1);
+        pad = offset + size > capacity_ ? capacity_ - offset : 0;
+        auto const used = t + pad + size - std::min(min_cursor(), t);
+        if (used > capacity_)
+            return false;
+        if (header_->tail.compare_exchange_weak(
+                t, t + pad + size, std::memory_order_relaxed))
+            break;
+    }
+
+    auto const key = header_->key;
+    if (pad != 0)
+    {
+        auto const r = reinterpret_cast<record *>(data_ + offset);
+        r->size = 0;
+        r->topic_size = 0;
+        r->flags = record::padding;
+        r->origin = static_cast<std::uint8_t>(slot_);
+        r->marker.store((t + 1) ^ key, std::memory_order_release);
+        t += pad;
+        offset = 0;
+    }
+
+    auto const r = reinterpret_cast<record *>(data_ + offset);
+    auto const p = data_ + offset + sizeof(record);
+    std::memcpy(p, topic.data(), topic.size());
+    std::memcpy(p + topic.size(), body[0].data(), body[0].size());
+    std::memcpy(
+        p + topic.size() + body[0].size(), body[1].data(), body[1].size());
+    r->size = static_cast<std::uint32_t>(topic.size() + msg.size());
+    r->topic_size = static_cast<std::uint16_t>(topic.size());
+    r->flags = (msg.binary() ? record::binary : 0) |
+        (msg.priority() == message_priority::high ? record::high : 0);
+    r->origin = static_cast<std::uint8_t>(slot_);
+    r->marker.store((t + 1) ^ key, std::memory_order_release);
+    return true;
+}
+
+void shm_ring::
+    run()
+{
+    if (!header_)
+        return;
+    net::dispatch(
+        timer_.get_executor(),
+        [self = shared_from_this()]
+        {
+            self->poll();
+        });
+}
+
+void shm_ring::
+    do_poll()
+{
+    timer_.expires_after(poll_interval_);
+    timer_.async_wait(
+        [self = shared_from_this()](error_code ec)
+        {
+            if (!ec)
+                self->poll();
+        });
+}
+
+void shm_ring::
+    poll()
+{
+    // Release the records of the messages which
+    // every session has finished writing
+    while (!leases_.empty() && leases_.front().second.expired())
+        leases_.pop_front();
+
+    // Deliver what the other processes appended, handing out
+    // messages which point into the mapping
+    auto const key = header_->key;
+    auto const tail = header_->tail.load(std::memory_order_acquire);
+    auto const first = next_;
+    std::size_t n = 0;
+    while (next_ != tail && n < 1024)
+    {
+        auto const offset = next_ & (capacity_ - 1);
+        auto const r = reinterpret_cast<record *>(data_ + offset);
+
+        // Records are delivered in order, wait for this one to
+        // be completed, unless its producer may have died
+        if (r->marker.load(std::memory_order_acquire) != ((next_ + 1) ^ key))
+        {
+            if (!abandoned())
+                break;
+            next_ = next_committed(tail);
+            continue;
+        }
+
+        if (r->flags & record::padding)
+        {
+            next_ += capacity_ - offset;
+            continue;
+        }
+
+        if (r->origin != slot_)
+        {
+            auto const p = reinterpret_cast<char const *>(r + 1);
+            std::shared_ptr<void const> owner =
+                std::make_shared<lease>(lease{map_});
+            leases_.push_back({next_, owner});
+            auto msg = make_message(
+                net::const_buffer(
+                    p + r->topic_size, r->size - r->topic_size),
+                std::move(owner),
+                std::string(p, r->topic_size),
+                (r->flags & record::binary) != 0);
+            if (r->flags & record::high)
+                msg->set_priority(message_priority::high);
+            state_->receive(std::move(msg));
+            ++n;
+        }
+        next_ += align(sizeof(record) + r->size);
+    }
+
+    header_->slots[slot_].cursor.store(
+        leases_.empty() ? next_ : leases_.front().first,
+        std::memory_order_release);
+    reap();
+
+    // Keep going while there is more to read
+    if (n > 0)
+        return net::post(
+            timer_.get_executor(),
+            [self = shared_from_this()]
+            {
+                self->poll();
+            });
+
+    // Back off while nothing happens. Records of this process,
+    // one still being written, or messages still being sent keep
+    // the interval short, the cursor then has to move on soon.
+    if (next_ != first || next_ != tail || !leases_.empty())
+        poll_interval_ = min_poll_interval;
+    else
+        poll_interval_ = std::min(2 * poll_interval_, max_poll_interval);
+    do_poll();
+}
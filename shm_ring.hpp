@@ -0,0 +1,141 @@
+#ifndef IR_WEBSOCKET_SERVER_SHM_RING_HPP
+#define IR_WEBSOCKET_SERVER_SHM_RING_HPP
+
+#include "message.hpp"
+#include "net.hpp"
+#include "ring_buffer.hpp"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+
+// Forward declaration
+class shared_state;
+
+/** A multi-producer broadcast ring in shared memory
+
+    Every server process on the host maps the same file in
+    /dev/shm. A broadcast is appended to the ring once, by the
+    process whose client sent it, and every other process reads
+    it from there. The messages a process reads point straight
+    into the mapping, so the sessions write the mapped bytes and
+    crossing processes costs no copy besides the append.
+
+    Space is reserved with a compare-and-swap on the shared tail,
+    and a record is committed by storing its position last. Each
+    process has a slot holding the position of the oldest record
+    it still references; a producer never overwrites a record
+    which some process has not released, it drops the broadcast
+    instead. A record is released once every session of the
+    reading process has finished writing it.
+
+    A process which dies between reserving a record and committing
+    it leaves a hole the readers would wait on forever. Once such
+    a process has been found dead, a reader stuck on a record which
+    was reserved before the death steps past it after a while, to
+    the next committed record.
+
+    Dead processes are found by their pid, so all the processes
+    sharing a ring must be in the same PID namespace: a process
+    refuses to open a ring created in another one.
+*/
+class shm_ring : public std::enable_shared_from_this<shm_ring>
+{
+    struct header;
+    struct record;
+
+    // The mapped file, unmapped when the last message
+    // pointing into it is gone
+    struct mapping
+    {
+        void *data = nullptr;
+        std::size_t size = 0;
+        ~mapping();
+    };
+
+    // Keeps the mapping alive for one message
+    struct lease
+    {
+        std::shared_ptr<mapping> map;
+    };
+
+    static constexpr std::size_t max_slots = 64;
+
+    // How often to look for new records. The interval starts
+    // short and doubles for as long as the ring stays idle, up
+    // to the longest one, so an idle process rarely wakes up.
+    static constexpr std::chrono::milliseconds min_poll_interval{1};
+    static constexpr std::chrono::milliseconds max_poll_interval{32};
+
+    // How long to wait on a record a dead process may have left
+    static constexpr std::chrono::milliseconds abandon_timeout{500};
+
+    std::shared_ptr<mapping> map_;
+    header *header_ = nullptr;
+    unsigned char *data_ = nullptr;
+    std::uint64_t capacity_ = 0;
+    std::size_t slot_ = 0;
+
+    // Only touched by the reader
+    std::shared_ptr<shared_state> state_;
+    net::steady_timer timer_;
+    std::uint64_t next_ = 0;
+    ring_buffer<std::pair<std::uint64_t, std::weak_ptr<void const>>> leases_;
+    std::chrono::steady_clock::time_point last_reap_;
+    std::chrono::milliseconds poll_interval_ = min_poll_interval;
+
+    // The uncommitted record the reader is waiting on, and since when
+    std::uint64_t stalled_at_ = ~std::uint64_t(0);
+    std::chrono::steady_clock::time_point stalled_since_;
+
+    static std::uint64_t align(std::uint64_t n) noexcept;
+    static std::uint64_t pid_namespace() noexcept;
+    void fail(char const *what);
+    bool open(std::string const &path, std::size_t size);
+    bool claim_slot();
+    void reap();
+    std::uint64_t min_cursor() const noexcept;
+    bool abandoned();
+    std::uint64_t next_committed(std::uint64_t tail) const noexcept;
+    void do_poll();
+    void poll();
+
+public:
+    /** Constructor
+
+        @param ioc The io_context to read the ring on. With the
+        shared-nothing engine this must be the one of `state`.
+
+        @param state Where to deliver the messages of the other
+        processes.
+
+        @param name The name of the file in /dev/shm.
+
+        @param size The capacity in bytes of a ring which does
+        not exist yet, rounded up to a power of two.
+    */
+    shm_ring(
+        net::io_context &ioc,
+        std::shared_ptr<shared_state> const &state,
+        std::string const &name,
+        std::size_t size);
+
+    ~shm_ring();
+
+    bool
+    is_open() const noexcept
+    {
+        return header_ != nullptr;
+    }
+
+    // Start reading the records of the other processes
+    void run();
+
+    // Append a message for the other processes, may be called from
+    // any thread. Returns false if the ring has no room for it.
+    bool publish(message const &msg);
+};
+
+#endif
@@ -0,0 +1,128 @@
+#include "slab_allocator.hpp"
+#include <array>
+#include <mutex>
+#include <new>
+
+// Blocks shared by all the threads
+struct slab_allocator::depot
+{
+    std::mutex mutex;
+    std::array<free_list, classes> lists;
+};
+
+// Each thread's free lists, given to the depot when the thread exits
+struct slab_allocator::cache
+{
+    std::array<free_list, classes> lists;
+
+    ~cache()
+    {
+        auto &d = shared();
+        std::lock_guard<std::mutex> lock(d.mutex);
+        for (std::size_t c = 0; c < classes; ++c)
+            lists[c].move(d.lists[c], lists[c].count);
+    }
+};
+
+void slab_allocator::free_list::
+    push(block *b) noexcept
+{
+    b->next = head;
+    head = b;
+    ++count;
+}
+
+slab_allocator::block *
+slab_allocator::free_list::
+    pop() noexcept
+{
+    auto const b = head;
+    head = b->next;
+    --count;
+    return b;
+}
+
+void slab_allocator::free_list::
+    move(free_list &to, std::size_t n) noexcept
+{
+    for (; n > 0 && head; --n)
+        to.push(pop());
+}
+
+slab_allocator::cache &
+slab_allocator::
+    local()
+{
+    thread_local cache c;
+    return c;
+}
+
+slab_allocator::depot &
+slab_allocator::
+    shared()
+{
+    // Never destroyed, threads may still exit
+    // while static objects are being destroyed
+    static depot *d = new depot;
+    return *d;
+}
+
+std::size_t
+slab_allocator::
+    size_class(std::size_t size) noexcept
+{
+    std::size_t c = 0;
+    while (c < classes && class_size(c) < size)
+        ++c;
+    return c;
+}
+
+// Fill an empty list with a slab's worth of blocks,
+// from the depot if it has some or from a new slab
+void slab_allocator::
+    refill(free_list &list, std::size_t c)
+{
+    auto const n = slab_size / class_size(c);
+    {
+        auto &d = shared();
+        std::lock_guard<std::mutex> lock(d.mutex);
+        d.lists[c].move(list, n);
+    }
+    if (list.head)
+        return;
+
+    auto const slab = static_cast<char *>(::operator new(slab_size));
+    for (std::size_t i = 0; i < n; ++i)
+        list.push(reinterpret_cast<block *>(slab + i * class_size(c)));
+}
+
+void *
+slab_allocator::
+    allocate(std::size_t c, std::size_t size)
+{
+    if (c >= classes)
+        return ::operator new(size);
+    auto &list = local().lists[c];
+    if (!list.head)
+        refill(list, c);
+    return list.pop();
+}
+
+void slab_allocator::
+    deallocate(void *p, std::size_t c) noexcept
+{
+    if (c >= classes)
+        return ::operator delete(p);
+    auto &list = local().lists[c];
+    list.push(static_cast<block *>(p));
+
+    // Keep up to four slabs' worth, give half of the rest
+    // back for the threads which run out
+    auto const n = 4 * slab_size / class_size(c);
+    if (list.count > n)
+    {
+        auto &d = shared();
+        std::lock_guard<std::mutex> lock(d.mutex);
+        list.move(d.lists[c], n / 2);
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef IR_WEBSOCKET_SERVER_SLAB_ALLOCATOR_HPP
+#define IR_WEBSOCKET_SERVER_SLAB_ALLOCATOR_HPP
+
+#include <cstddef>
+
+/** A size-classed allocator carving blocks out of large slabs
+
+    Blocks come in power of two size classes from 256 bytes to
+    16 KiB. Each thread keeps a free list for every class, so
+    allocating and freeing usually touches no lock and no shared
+    cache line. A thread holding too many free blocks of a class
+    hands a batch to a shared depot, where the threads which run
+    out pick them up again: a message built on one shard and
+    released on another comes back to the first this way.
+
+    The depot and the threads get new blocks by carving a 64 KiB
+    slab. Slabs are never returned to the heap, so the memory
+    used for blocks stays at its peak until the process exits.
+    Larger sizes are allocated from the heap directly.
+*/
+class slab_allocator
+{
+    struct block
+    {
+        block *next;
+    };
+
+    // A list of free blocks of one class
+    struct free_list
+    {
+        block *head = nullptr;
+        std::size_t count = 0;
+
+        void push(block *b) noexcept;
+        block *pop() noexcept;
+
+        // Move up to n blocks to another list
+        void move(free_list &to, std::size_t n) noexcept;
+    };
+
+    struct cache;
+    struct depot;
+
+    static constexpr std::size_t slab_size = 64 * 1024;
+
+    static cache &local();
+    static depot &shared();
+    static void refill(free_list &list, std::size_t c);
+
+public:
+    static constexpr std::size_t classes = 7;
+    static constexpr std::size_t min_size = 256;
+
+    // Returns the class of a size, or `classes` if it has none
+    static std::size_t size_class(std::size_t size) noexcept;
+
+    // Returns the size of the blocks of a class
+    static std::size_t
+    class_size(std::size_t c) noexcept
+    {
+        return min_size << c;
+    }
+
+    // Allocate a block of class `c`, or of `size` bytes
+    // from the heap when `c` is `classes`
+    static void *allocate(std::size_t c, std::size_t size);
+    static void deallocate(void *p, std::size_t c) noexcept;
+};
+
+#endif
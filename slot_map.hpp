@@ -0,0 +1,163 @@
+#ifndef IR_WEBSOCKET_SERVER_SLOT_MAP_HPP
+#define IR_WEBSOCKET_SERVER_SLOT_MAP_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/** A container handing out generation-checked 64-bit ids
+
+    The values are packed in one dense array, in no particular
+    order, so visiting all of them walks contiguous memory. An id
+    names a slot, which records where its value currently is in
+    the dense array. Erasing moves the last value into the hole
+    and updates its slot, so it costs O(1) and leaves the ids of
+    the other values valid.
+
+    An id is the slot index in its low 32 bits and the slot's
+    24-bit generation in the next 24 bits. The top 8 bits are left
+    to the owner, which may tag the ids it hands out with them:
+    find and erase ignore them. The generation changes every
+    time the slot is reused, so a stale id finds nothing instead
+    of the slot's next value. Generations of new slots start at
+    pseudo-random values drawn from the seed, which keeps ids
+    from different maps apart and hard to guess.
+*/
+template <class T>
+class slot_map
+{
+    static constexpr std::uint32_t npos = 0xffffffff;
+    static constexpr std::uint32_t generation_mask = 0x00ffffff;
+
+    struct slot
+    {
+        std::uint32_t generation;
+
+        // The position of the value, or the next free slot
+        std::uint32_t index;
+    };
+
+    std::vector<slot> slots_;
+    std::vector<T> values_;
+
+    // The slot of each value
+    std::vector<std::uint32_t> owners_;
+
+    std::uint32_t free_ = npos;
+    std::uint64_t seed_;
+
+    // splitmix64
+    std::uint32_t
+    next_generation() noexcept
+    {
+        auto z = (seed_ += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return static_cast<std::uint32_t>(z ^ (z >> 31)) & generation_mask;
+    }
+
+    static std::uint64_t
+    make_id(std::uint32_t generation, std::uint32_t index) noexcept
+    {
+        return (static_cast<std::uint64_t>(generation) << 32) | index;
+    }
+
+public:
+    explicit slot_map(std::uint64_t seed = 0) noexcept
+        : seed_(seed)
+    {
+    }
+
+    std::size_t
+    size() const noexcept
+    {
+        return values_.size();
+    }
+
+    bool
+    empty() const noexcept
+    {
+        return values_.empty();
+    }
+
+    // Add a value, returning its id, which is never zero
+    // and has its top 8 bits clear
+    std::uint64_t
+    insert(T value)
+    {
+        std::uint32_t i;
+        if (free_ != npos)
+        {
+            i = free_;
+            free_ = slots_[i].index;
+        }
+        else
+        {
+            i = static_cast<std::uint32_t>(slots_.size());
+            slots_.push_back({next_generation(), 0});
+        }
+        if (make_id(slots_[i].generation, i) == 0)
+            slots_[i].generation = 1;
+
+        values_.push_back(std::move(value));
+        owners_.push_back(i);
+        slots_[i].index = static_cast<std::uint32_t>(values_.size() - 1);
+        return make_id(slots_[i].generation, i);
+    }
+
+    // Returns the value of `id`, or null if it was erased
+    T *
+    find(std::uint64_t id) noexcept
+    {
+        auto const i = static_cast<std::uint32_t>(id);
+        if (i >= slots_.size() ||
+            slots_[i].generation !=
+                (static_cast<std::uint32_t>(id >> 32) & generation_mask) ||
+            slots_[i].index >= values_.size() ||
+            owners_[slots_[i].index] != i)
+            return nullptr;
+        return &values_[slots_[i].index];
+    }
+
+    // Returns false if `id` was already erased
+    bool
+    erase(std::uint64_t id)
+    {
+        if (!find(id))
+            return false;
+        auto const i = static_cast<std::uint32_t>(id);
+        auto const pos = slots_[i].index;
+
+        // Fill the hole with the last value
+        if (pos != values_.size() - 1)
+        {
+            values_[pos] = std::move(values_.back());
+            owners_[pos] = owners_.back();
+            slots_[owners_[pos]].index = pos;
+        }
+        values_.pop_back();
+        owners_.pop_back();
+
+        // Retire the id and put the slot on the free list
+        slots_[i].generation = (slots_[i].generation + 1) & generation_mask;
+        slots_[i].index = free_;
+        free_ = i;
+        return true;
+    }
+
+    // The values, densely packed
+    T *
+    begin() noexcept
+    {
+        return values_.data();
+    }
+
+    T *
+    end() noexcept
+    {
+        return values_.data() + values_.size();
+    }
+};
+
+#endif
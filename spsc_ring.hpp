@@ -0,0 +1,77 @@
+#ifndef IR_WEBSOCKET_SERVER_SPSC_RING_HPP
+#define IR_WEBSOCKET_SERVER_SPSC_RING_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/** A bounded lock-free single-producer single-consumer queue
+
+    Exactly one thread may call try_push and exactly one
+    (possibly different) thread may call try_pop. The
+    capacity is rounded up to a power of two.
+*/
+template <class T>
+class spsc_ring
+{
+    std::vector<T> slots_;
+    std::size_t mask_;
+
+    // Keep the indices on separate cache lines so the
+    // producer and the consumer do not false-share.
+    alignas(64) std::atomic<std::size_t> head_{0};
+    alignas(64) std::atomic<std::size_t> tail_{0};
+
+    static std::size_t
+    round_up(std::size_t n)
+    {
+        std::size_t size = 2;
+        while (size < n)
+            size <<= 1;
+        return size;
+    }
+
+public:
+    explicit spsc_ring(std::size_t capacity)
+        : slots_(round_up(capacity)), mask_(slots_.size() - 1)
+    {
+    }
+
+    spsc_ring(spsc_ring const &) = delete;
+    spsc_ring &operator=(spsc_ring const &) = delete;
+
+    std::size_t
+    capacity() const noexcept
+    {
+        return slots_.size();
+    }
+
+    // Called by the producer. Returns false if the ring is full.
+    template <class U>
+    bool
+    try_push(U &&value)
+    {
+        auto const tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == slots_.size())
+            return false;
+        slots_[tail & mask_] = std::forward<U>(value);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Called by the consumer. Returns false if the ring is empty.
+    bool
+    try_pop(T &value)
+    {
+        auto const head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire))
+            return false;
+        value = std::move(slots_[head & mask_]);
+        slots_[head & mask_] = T{};
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef IR_WEBSOCKET_SERVER_TEST_ALLOCATION_COUNTER_HPP
+#define IR_WEBSOCKET_SERVER_TEST_ALLOCATION_COUNTER_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+/** Replaces the global operator new to count heap allocations
+
+    Include it in exactly one translation unit of a test program.
+*/
+inline std::atomic<std::size_t> allocations{0};
+
+void *
+operator new(std::size_t size)
+{
+    ++allocations;
+    if (auto p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void
+operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void
+operator delete(void *p, std::size_t) noexcept
+{
+    ::operator delete(p);
+}
+
+#endif
@@ -0,0 +1,209 @@
+// Counts the heap allocations of shared_state::broadcast for a
+// growing number of subscribers, which should not depend on it.
+// Fails if a broadcast allocates more than once on average.
+
+#include "allocation_counter.hpp"
+#include "beast.hpp"
+#include "handler_memory.hpp"
+#include "message.hpp"
+#include "net.hpp"
+#include "server_options.hpp"
+#include "shared_state.hpp"
+#include "websocket_session.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+// Reads and discards what the server writes to one subscriber
+class subscriber
+{
+    handler_memory::pointer memory_ = handler_memory::create();
+    tcp::socket socket_;
+    std::vector<char> buffer_;
+    std::size_t &received_;
+    std::function<void()> const &on_read_;
+
+public:
+    subscriber(
+        net::io_context &ioc,
+        std::size_t &received,
+        std::function<void()> const &on_read)
+        : socket_(ioc)
+        , buffer_(64 * 1024)
+        , received_(received)
+        , on_read_(on_read)
+    {
+    }
+
+    tcp::socket &
+    socket() noexcept
+    {
+        return socket_;
+    }
+
+    void
+    do_read()
+    {
+        socket_.async_read_some(
+            net::buffer(buffer_),
+            bind_memory(
+                *memory_,
+                [this](error_code ec, std::size_t bytes)
+                {
+                    if (ec)
+                        return;
+                    received_ += bytes;
+                    on_read_();
+                    do_read();
+                }));
+    }
+};
+
+// Makes the upgrade request of a client holding a valid token
+static http::request<http::string_body>
+upgrade_request()
+{
+    auto const token = jwt::create<jwt::traits::boost_json>()
+        .set_issuer("auth0")
+        .set_audience("aud0")
+        .set_issued_at(std::chrono::system_clock::now())
+        .set_expires_at(std::chrono::system_clock::now() + std::chrono::seconds{3600})
+        .sign(jwt::algorithm::hs256{"secret"});
+
+    http::request<http::string_body> req{
+        http::verb::get, "/?token=" + token, 11};
+    req.set(http::field::host, "127.0.0.1");
+    req.set(http::field::upgrade, "websocket");
+    req.set(http::field::connection, "upgrade");
+    req.set(http::field::sec_websocket_key, "dGhlIHNhbXBsZSBub25jZQ==");
+    req.set(http::field::sec_websocket_version, "13");
+    return req;
+}
+
+// Returns the allocations per broadcast to n subscribers
+static double
+bench(std::size_t n, std::size_t rounds)
+{
+    server_options opts;
+    opts.presence = false;
+
+    net::io_context ioc(1);
+    auto const state = std::make_shared<shared_state>(".", opts);
+    state->start(ioc);
+    tcp::acceptor acceptor(ioc, {net::ip::make_address("127.0.0.1"), 0});
+
+    // Every session is accepted on a strand, like the listener does
+    std::size_t received = 0;
+    std::function<void()> on_read = [] {};
+    std::vector<std::unique_ptr<subscriber>> subscribers;
+    auto const req = upgrade_request();
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        subscribers.push_back(
+            std::make_unique<subscriber>(ioc, received, on_read));
+        subscribers.back()->socket().connect(acceptor.local_endpoint());
+        session_socket socket(net::make_strand(ioc));
+        acceptor.accept(socket);
+        std::make_shared<websocket_session>(std::move(socket), state)->run(req);
+        subscribers.back()->do_read();
+    }
+
+    // One unmasked frame of each broadcast reaches every subscriber
+    message_ptr const msg = make_message(std::string(64, 'x'));
+    std::size_t const frame = 2 + msg->payload().size();
+    std::size_t const warmup = 100;
+    std::size_t round = 0;
+    std::size_t expected = 0;
+    std::size_t before = 0;
+    std::size_t after = 0;
+    auto const next = [&]
+    {
+        if (round == warmup)
+            before = allocations.load();
+        if (round++ == warmup + rounds)
+        {
+            after = allocations.load();
+            return ioc.stop();
+        }
+        expected = received + n * frame;
+        state->broadcast(msg);
+    };
+
+    // Start once the upgrades and greetings stopped arriving
+    net::steady_timer timer(ioc);
+    std::size_t settled = 0;
+    std::function<void(error_code)> wait = [&](error_code)
+    {
+        if (settled != received || received == 0)
+        {
+            settled = received;
+            timer.expires_after(std::chrono::milliseconds(100));
+            return timer.async_wait(wait);
+        }
+        on_read = [&]
+        {
+            if (received >= expected)
+                next();
+        };
+        next();
+    };
+    timer.expires_after(std::chrono::milliseconds(100));
+    timer.async_wait(wait);
+    ioc.run();
+
+    return static_cast<double>(after - before) / rounds;
+}
+
+// Returns how many subscribers the descriptor limit leaves room
+// for, raising the limit as far as allowed. Every subscriber
+// takes two descriptors, the server's and the client's.
+static std::size_t
+max_subscribers()
+{
+#ifndef _WIN32
+    rlimit rl{};
+    if (::getrlimit(RLIMIT_NOFILE, &rl) != 0)
+        return 1000;
+    if (rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        ::setrlimit(RLIMIT_NOFILE, &rl);
+        ::getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (rl.rlim_cur == RLIM_INFINITY)
+        return 1000;
+    return rl.rlim_cur > 128 ? (rl.rlim_cur - 64) / 2 : 1;
+#else
+    return 1000;
+#endif
+}
+
+int
+main(int argc, char *argv[])
+{
+    std::size_t const rounds = argc > 1 ? std::stoul(argv[1]) : 1000;
+    std::size_t const limit = max_subscribers();
+    int result = EXIT_SUCCESS;
+    for (std::size_t n : {1, 10, 100, 1000})
+    {
+        if (n > limit)
+        {
+            std::cout << "descriptors run out at " << limit
+                      << " subscribers, using that many\n";
+            n = limit;
+        }
+        auto const per_broadcast = bench(n, rounds);
+        std::cout << n << " subscribers: " << per_broadcast
+                  << " allocations per broadcast\n";
+        if (per_broadcast > 1)
+            result = EXIT_FAILURE;
+    }
+    return result;
+}
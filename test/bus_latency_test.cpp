@@ -0,0 +1,276 @@
+// Starts three server processes joined by the local bus, and measures
+// how long a message sent to one takes to reach clients of the others.
+// Each server has two peers, and a burst sent without waiting makes
+// the messages queued behind a write to a peer go out together.
+
+#include "beast.hpp"
+#include "net.hpp"
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using clock_type = std::chrono::steady_clock;
+
+// Start the server with the given arguments, it is
+// terminated if this process dies first
+static pid_t
+spawn(char const *exe, std::vector<std::string> args)
+{
+    auto const pid = ::fork();
+    if (pid != 0)
+        return pid;
+    ::prctl(PR_SET_PDEATHSIG, SIGTERM);
+    args.insert(args.begin(), exe);
+    std::vector<char *> argv;
+    for (auto &arg : args)
+        argv.push_back(&arg[0]);
+    argv.push_back(nullptr);
+    ::execv(exe, argv.data());
+    std::perror("execv");
+    ::_exit(127);
+}
+
+// Returns a port nobody listens on at the moment
+static unsigned short
+free_port(net::io_context &ioc)
+{
+    tcp::acceptor acceptor(ioc, {net::ip::make_address("127.0.0.1"), 0});
+    return acceptor.local_endpoint().port();
+}
+
+// Get a token from the server, waiting for it to start
+static std::string
+get_token(net::io_context &ioc, unsigned short port)
+{
+    auto const deadline = clock_type::now() + std::chrono::seconds(10);
+    tcp::socket socket(ioc);
+    for (;;)
+    {
+        error_code ec;
+        socket.connect({net::ip::make_address("127.0.0.1"), port}, ec);
+        if (!ec)
+            break;
+        if (clock_type::now() > deadline)
+            throw std::runtime_error("server did not start");
+        socket.close();
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+
+    http::request<http::empty_body> req{http::verb::get, "/api/ws", 11};
+    req.set(http::field::host, "127.0.0.1");
+    http::write(socket, req);
+    beast::flat_buffer buffer;
+    http::response<http::string_body> res;
+    http::read(socket, buffer, res);
+
+    // The body is the token as a JSON string
+    auto token = res.body();
+    token.erase(std::remove(token.begin(), token.end(), '"'), token.end());
+    return token;
+}
+
+// A websocket client of one server
+class client
+{
+    net::io_context &ioc_;
+    websocket::stream<tcp::socket> ws_;
+    beast::flat_buffer buffer_;
+    error_code ec_;
+    bool reading_ = false;
+    bool ready_ = false;
+
+public:
+    client(net::io_context &ioc, unsigned short port, std::string const &token)
+        : ioc_(ioc)
+        , ws_(ioc)
+    {
+        ws_.next_layer().connect({net::ip::make_address("127.0.0.1"), port});
+        ws_.handshake("127.0.0.1", "/?token=" + token);
+    }
+
+    void
+    send(std::string const &text)
+    {
+        ws_.write(net::buffer(text));
+    }
+
+    // Wait up to `timeout` for the next message, a read
+    // left pending on timeout is continued by the next call
+    bool
+    receive(std::string &text, clock_type::duration timeout)
+    {
+        if (!reading_)
+        {
+            reading_ = true;
+            ws_.async_read(
+                buffer_,
+                [this](error_code ec, std::size_t)
+                {
+                    reading_ = false;
+                    ready_ = true;
+                    ec_ = ec;
+                });
+        }
+        // The io_context stopped when it last ran out of work
+        if (ioc_.stopped())
+            ioc_.restart();
+        auto const deadline = clock_type::now() + timeout;
+        while (!ready_ && ioc_.run_one_until(deadline))
+            ;
+        if (!ready_)
+            return false;
+        ready_ = false;
+        if (ec_)
+            throw beast::system_error(ec_);
+        text = beast::buffers_to_string(buffer_.data());
+        buffer_.consume(buffer_.size());
+        return true;
+    }
+
+    // Wait for a message equal to `text`, skipping the others
+    bool
+    expect(std::string const &text, clock_type::duration timeout)
+    {
+        auto const deadline = clock_type::now() + timeout;
+        std::string got;
+        while (receive(got, deadline - clock_type::now()))
+            if (got == text)
+                return true;
+        return false;
+    }
+};
+
+static int
+run(char const *exe, char const *doc_root, std::size_t count, double bound)
+{
+    net::io_context ioc;
+    std::string const dir = "/tmp/bus_latency_test." + std::to_string(::getpid());
+    std::vector<std::string> const paths{
+        dir + ".a.sock", dir + ".b.sock", dir + ".c.sock"};
+    std::vector<unsigned short> ports;
+    std::vector<pid_t> servers;
+    for (std::size_t i = 0; i < paths.size(); ++i)
+    {
+        ports.push_back(free_port(ioc));
+        std::vector<std::string> args{
+            "127.0.0.1", std::to_string(ports.back()), doc_root,
+            "--no-presence", "--bus", paths[i]};
+        for (std::size_t j = 0; j < paths.size(); ++j)
+        {
+            if (j == i)
+                continue;
+            args.push_back("--bus-peer");
+            args.push_back(paths[j]);
+        }
+        servers.push_back(spawn(exe, args));
+    }
+
+    int result = EXIT_FAILURE;
+    try
+    {
+        client sender(ioc, ports[0], get_token(ioc, ports[0]));
+        std::vector<std::unique_ptr<client>> receivers;
+        for (std::size_t i = 1; i < ports.size(); ++i)
+            receivers.push_back(std::make_unique<client>(
+                ioc, ports[i], get_token(ioc, ports[i])));
+
+        // The servers connect to each other with a delay
+        for (auto const &receiver : receivers)
+        {
+            bool joined = false;
+            for (int i = 0; !joined && i < 50; ++i)
+            {
+                auto const probe = "probe " + std::to_string(i);
+                sender.send(probe);
+                joined = receiver->expect(probe, std::chrono::milliseconds(200));
+            }
+            if (!joined)
+                throw std::runtime_error("the bus did not connect");
+        }
+
+        // Until the last receiver has it
+        std::vector<double> latencies;
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            auto const text = "latency " + std::to_string(i);
+            auto const start = clock_type::now();
+            sender.send(text);
+            for (auto const &receiver : receivers)
+                if (!receiver->expect(text, std::chrono::seconds(5)))
+                    throw std::runtime_error("lost " + text);
+            latencies.push_back(std::chrono::duration<double, std::micro>(
+                clock_type::now() - start).count());
+
+            // Our own copy of the broadcast
+            if (!sender.expect(text, std::chrono::seconds(5)))
+                throw std::runtime_error("no echo of " + text);
+        }
+
+        // Every message of a burst arrives, in order
+        std::size_t const burst = 100;
+        for (std::size_t i = 0; i < burst; ++i)
+            sender.send("burst " + std::to_string(i));
+        for (auto const &receiver : receivers)
+            for (std::size_t i = 0; i < burst; ++i)
+                if (!receiver->expect(
+                        "burst " + std::to_string(i), std::chrono::seconds(5)))
+                    throw std::runtime_error(
+                        "lost burst " + std::to_string(i));
+
+        std::sort(latencies.begin(), latencies.end());
+        auto const p99 = latencies[count * 99 / 100];
+        std::printf(
+            "%zu messages across the bus to %zu peers: min %.0f us, "
+            "median %.0f us, p99 %.0f us, max %.0f us\n",
+            count,
+            receivers.size(),
+            latencies.front(),
+            latencies[count / 2],
+            p99,
+            latencies.back());
+        if (p99 > bound)
+            throw std::runtime_error(
+                "p99 above " + std::to_string(bound) + " us");
+        result = EXIT_SUCCESS;
+    }
+    catch (std::exception const &e)
+    {
+        std::cerr << "bus_latency_test: " << e.what() << "\n";
+    }
+
+    for (auto pid : servers)
+    {
+        ::kill(pid, SIGTERM);
+        ::waitpid(pid, nullptr, 0);
+    }
+    for (auto const &path : paths)
+        ::unlink(path.c_str());
+    return result;
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        std::cerr << "Usage: bus_latency_test <server> <doc_root> [count] [p99 bound in us]\n";
+        return EXIT_FAILURE;
+    }
+    std::size_t const count = argc > 3 ? std::stoul(argv[3]) : 1000;
+
+    // Generous, a loaded machine running the tests in parallel
+    // must not fail it, a lost wakeup or a timer in the path does
+    double const bound = argc > 4 ? std::stod(argv[4]) : 50000;
+    return run(argv[1], argv[2], count == 0 ? 1 : count, bound);
+}
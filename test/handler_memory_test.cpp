@@ -0,0 +1,153 @@
+// Checks that a client's messages relayed back to it by a real
+// listener and websocket_session, every handler bound to
+// handler_memory, perform no heap allocation once the server
+// reached its steady state
+
+#include "allocation_counter.hpp"
+#include "beast.hpp"
+#include "handler_memory.hpp"
+#include "listener.hpp"
+#include "net.hpp"
+#include "server_options.hpp"
+#include "shared_state.hpp"
+#include "websocket_session.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+
+// Sends a message and waits for the server to relay it back,
+// counting the allocations of the last rounds, then stops the
+// io_context
+class echo_client
+{
+    handler_memory::pointer memory_ = handler_memory::create();
+    net::io_context &ioc_;
+    websocket::stream<session_socket> ws_;
+    beast::flat_buffer buffer_;
+    std::string message_;
+    std::size_t rounds_ = 0;
+    std::size_t measured_ = 0;
+    std::size_t before_ = 0;
+    std::size_t after_ = 0;
+
+public:
+    explicit echo_client(net::io_context &ioc)
+        : ioc_(ioc)
+        , ws_(net::make_strand(ioc))
+        , message_(512, 'x')
+    {
+    }
+
+    websocket::stream<session_socket> &
+    stream() noexcept
+    {
+        return ws_;
+    }
+
+    // Returns the allocations made during the measured rounds
+    std::size_t
+    allocated() const noexcept
+    {
+        return after_ - before_;
+    }
+
+    bool
+    done() const noexcept
+    {
+        return rounds_ == 0;
+    }
+
+    void
+    run(std::size_t warmup, std::size_t measured)
+    {
+        rounds_ = warmup + measured;
+        measured_ = measured;
+        do_write();
+    }
+
+    void
+    do_write()
+    {
+        if (rounds_ == measured_)
+            before_ = allocations.load();
+        ws_.async_write(
+            net::buffer(message_),
+            bind_memory(
+                *memory_,
+                [this](error_code ec, std::size_t)
+                {
+                    if (ec)
+                        return ioc_.stop();
+                    ws_.async_read(
+                        buffer_,
+                        bind_memory(
+                            *memory_,
+                            [this](error_code ec, std::size_t)
+                            {
+                                if (ec)
+                                    return ioc_.stop();
+                                buffer_.consume(buffer_.size());
+                                if (--rounds_ != 0)
+                                    return do_write();
+                                after_ = allocations.load();
+                                ioc_.stop();
+                            }));
+                }));
+    }
+};
+
+int
+main()
+{
+    server_options opts;
+    opts.presence = false;
+
+    net::io_context ioc(1);
+    auto const state = std::make_shared<shared_state>(".", opts);
+    state->start(ioc);
+    auto const l = std::make_shared<listener>(
+        ioc, tcp::endpoint{net::ip::make_address("127.0.0.1"), 0}, state);
+    l->run();
+
+    echo_client client(ioc);
+    client.stream().next_layer().connect(l->local_endpoint());
+    auto const token = jwt::create<jwt::traits::boost_json>()
+        .set_issuer("auth0")
+        .set_audience("aud0")
+        .set_issued_at(std::chrono::system_clock::now())
+        .set_expires_at(std::chrono::system_clock::now() + std::chrono::seconds{3600})
+        .sign(jwt::algorithm::hs256{"secret"});
+
+    // Asio recycles some memory per running thread, so all rounds run
+    // in one call to run, like on a server thread. The first rounds
+    // fill the recycled memory and grow the buffers.
+    std::size_t const rounds = 10000;
+    beast::flat_buffer greeting;
+    client.stream().async_handshake(
+        "127.0.0.1", "/?token=" + token,
+        [&](error_code ec)
+        {
+            if (ec)
+            {
+                std::cerr << "handshake: " << ec.message() << "\n";
+                return ioc.stop();
+            }
+            client.stream().async_read(
+                greeting,
+                [&](error_code ec, std::size_t)
+                {
+                    if (ec)
+                        return ioc.stop();
+                    client.run(1000, rounds);
+                });
+        });
+    ioc.run();
+
+    if (!client.done())
+        return EXIT_FAILURE;
+    std::cout << client.allocated() << " allocations in "
+              << rounds << " round trips\n";
+    return client.allocated() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
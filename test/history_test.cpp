@@ -0,0 +1,133 @@
+// Checks that with a history only plain text broadcasts are
+// numbered, binary messages and presence JSON arrive unchanged,
+// both live and replayed
+
+#include "beast.hpp"
+#include "listener.hpp"
+#include "net.hpp"
+#include "server_options.hpp"
+#include "shared_state.hpp"
+#include "websocket_session.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+using client = websocket::stream<tcp::socket>;
+
+static void
+connect(client &ws, tcp::endpoint const &ep)
+{
+    auto const token = jwt::create<jwt::traits::boost_json>()
+        .set_issuer("auth0")
+        .set_audience("aud0")
+        .set_issued_at(std::chrono::system_clock::now())
+        .set_expires_at(std::chrono::system_clock::now() + std::chrono::seconds{3600})
+        .sign(jwt::algorithm::hs256{"secret"});
+    ws.next_layer().connect(ep);
+    ws.handshake("127.0.0.1", "/?token=" + token);
+}
+
+static void
+check(bool ok, char const *what)
+{
+    if (!ok)
+        throw std::runtime_error(what);
+}
+
+// Reads the next message, checking any presence delta on the way
+static std::string
+next(client &ws, bool &presence)
+{
+    for (;;)
+    {
+        beast::flat_buffer buffer;
+        ws.read(buffer);
+        auto s = beast::buffers_to_string(buffer.data());
+        if (ws.got_binary() || s.find("presence") == std::string::npos)
+            return s;
+        check(s.rfind(R"({"type":"presence","joined":[)", 0) == 0 &&
+                  s.back() == '}',
+              "presence JSON was changed");
+        presence = true;
+    }
+}
+
+int
+main()
+{
+    server_options opts;
+    opts.history = 16;
+    opts.presence_window = 10;
+
+    net::io_context ioc(1);
+    auto const state = std::make_shared<shared_state>(".", opts);
+    state->start(ioc);
+    auto const l = std::make_shared<listener>(
+        ioc, tcp::endpoint{net::ip::make_address("127.0.0.1"), 0}, state);
+    l->run();
+    auto const ep = l->local_endpoint();
+    auto work = net::make_work_guard(ioc);
+    std::thread t([&] { ioc.run(); });
+
+    int result = EXIT_FAILURE;
+    try
+    {
+        net::io_context cioc;
+        client a(cioc);
+        client b(cioc);
+        connect(a, ep);
+        connect(b, ep);
+
+        // Let the presence delta of the two joins go out first
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        // The greeting is sent to one session, it has no number
+        bool presence = false;
+        auto s = next(a, presence);
+        check(s.rfind("you connected as :", 0) == 0, "greeting was changed");
+
+        std::string bytes;
+        for (int i = 0; i < 256; ++i)
+            bytes.push_back(static_cast<char>(i));
+
+        // Relayed from a client, the binary message is untouched
+        b.binary(true);
+        b.write(net::buffer(bytes));
+        s = next(a, presence);
+        check(a.got_binary() && s == bytes, "binary message was changed");
+
+        // A text line is numbered
+        b.text(true);
+        b.write(net::buffer(std::string("hello")));
+        s = next(a, presence);
+        check(!a.got_binary() && s.size() > 7 && s[0] == '#' &&
+                  s.compare(s.size() - 6, 6, " hello") == 0,
+              "text message was not numbered");
+        check(presence, "no presence delta");
+
+        // And so are they when replayed
+        presence = false;
+        a.text(true);
+        a.write(net::buffer(std::string("/replay 0")));
+        s = next(a, presence);
+        check(a.got_binary() && s == bytes, "replayed binary message was changed");
+        s = next(a, presence);
+        check(s.size() > 7 && s[0] == '#' &&
+                  s.compare(s.size() - 6, 6, " hello") == 0,
+              "replayed text message was not numbered");
+        check(presence, "presence delta was not replayed");
+        result = EXIT_SUCCESS;
+    }
+    catch (std::exception const &e)
+    {
+        std::cerr << "history_test: " << e.what() << "\n";
+    }
+
+    ioc.stop();
+    t.join();
+    return result;
+}
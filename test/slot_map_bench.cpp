@@ -0,0 +1,120 @@
+// Times connect, get and disconnect on the session table at 1M
+// entries, against the string-keyed map it replaced
+
+#include "slot_map.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Laid out like the connections of shared_state
+struct connection
+{
+    void *session = nullptr;
+    std::weak_ptr<void> weak;
+    std::vector<std::string> topics;
+};
+
+using clock_type = std::chrono::steady_clock;
+
+// Prints the time per operation of n operations since `start`
+static void
+report(char const *what, clock_type::time_point start, std::size_t n)
+{
+    auto const ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        clock_type::now() - start)
+                        .count();
+    std::printf(
+        "  %-12s %8.1f ns/op\n", what, static_cast<double>(ns) / n);
+}
+
+static std::string
+to_string_id(std::uint64_t id)
+{
+    char s[17];
+    std::snprintf(s, sizeof(s), "%016llx",
+        static_cast<unsigned long long>(id));
+    return s;
+}
+
+static void
+bench_slot_map(std::size_t n, std::mt19937_64 &rng)
+{
+    std::cout << "slot_map<connection>\n";
+    slot_map<connection> map(rng());
+    std::vector<std::uint64_t> ids;
+    ids.reserve(n);
+
+    auto start = clock_type::now();
+    for (std::size_t i = 0; i < n; ++i)
+        ids.push_back(map.insert({&map, {}, {}}));
+    report("connect", start, n);
+
+    std::shuffle(ids.begin(), ids.end(), rng);
+    std::size_t found = 0;
+    start = clock_type::now();
+    for (auto id : ids)
+        found += map.find(id) != nullptr;
+    report("get", start, n);
+
+    start = clock_type::now();
+    for (auto id : ids)
+        map.erase(id);
+    report("disconnect", start, n);
+
+    // Reconnecting reuses the freed slots
+    start = clock_type::now();
+    for (std::size_t i = 0; i < n; ++i)
+        ids[i] = map.insert({&map, {}, {}});
+    report("reconnect", start, n);
+
+    if (found != n || map.size() != n)
+        std::cout << "  unexpected size\n";
+}
+
+static void
+bench_string_map(std::size_t n, std::mt19937_64 &rng)
+{
+    std::cout << "unordered_map<std::string, void*>\n";
+    std::unordered_map<std::string, void *> map;
+    std::vector<std::string> ids;
+    ids.reserve(n);
+    for (std::size_t i = 0; i < n; ++i)
+        ids.push_back(to_string_id(rng()));
+
+    auto start = clock_type::now();
+    for (auto const &id : ids)
+        map.emplace(id, &map);
+    report("connect", start, n);
+
+    std::shuffle(ids.begin(), ids.end(), rng);
+    std::size_t found = 0;
+    start = clock_type::now();
+    for (auto const &id : ids)
+        found += map.find(id) != map.end();
+    report("get", start, n);
+
+    start = clock_type::now();
+    for (auto const &id : ids)
+        map.erase(id);
+    report("disconnect", start, n);
+
+    if (found != n)
+        std::cout << "  unexpected size\n";
+}
+
+int
+main(int argc, char *argv[])
+{
+    std::size_t const n = argc > 1 ? std::stoul(argv[1]) : 1000000;
+    std::mt19937_64 rng(42);
+    std::cout << n << " entries\n";
+    bench_slot_map(n, rng);
+    bench_string_map(n, rng);
+}
@@ -1,17 +1,88 @@
 #include "websocket_session.hpp"
+#include <algorithm>
+
+// A piece of a streamed message, which gives its bytes back to
+// the session reading the message once every recipient wrote it
+struct websocket_session::chunk
+{
+    beast::flat_buffer buffer;
+    std::weak_ptr<websocket_session> reader;
+    std::size_t recycle = 0;
+
+    ~chunk()
+    {
+        if (auto sp = reader.lock())
+            sp->release(buffer.size());
+        session_pool::local().give_back(std::move(buffer), recycle);
+    }
+};
 
 websocket_session::
     websocket_session(
-        tcp::socket socket,
+        session_socket socket,
         std::shared_ptr<shared_state> const &state)
-    : ws_(std::move(socket)), state_(state)
+    : buffer_(session_pool::local().take_buffer())
+    , ws_(std::move(socket)), state_(state)
+    , queues_{{
+          ring_buffer<message_ptr>(),
+          ring_buffer<message_ptr>(queue_capacity(state->options()))}}
+    , stream_timer_(ws_.get_executor())
+    , timer_(ws_.get_executor())
+    , resource_(value_buffer_.data(), value_buffer_.size())
+    , parser_(
+          json::storage_ptr(),
+          json::parse_options(),
+          parse_buffer_.data(),
+          parse_buffer_.size())
 {
+    auto const &opts = state_->options();
+    if (opts.read_message_max != 0)
+        ws_.read_message_max(opts.read_message_max);
+    if (opts.rate_limit != 0 || opts.rate_limit_bytes != 0)
+        limiter_ = std::make_unique<rate_limiter>(
+            opts.rate_limit, opts.rate_limit_bytes);
+
+    writing_.reserve(std::max<std::size_t>(1, opts.coalesce));
+    if (opts.coalesce > 1)
+    {
+        headers_.resize(opts.coalesce);
+        buffers_.reserve(3 * opts.coalesce);
+    }
+
+    if (opts.deflate)
+    {
+        websocket::permessage_deflate pmd;
+        pmd.server_enable = true;
+        pmd.compLevel = opts.deflate_level;
+        pmd.memLevel = opts.deflate_mem_level;
+
+        // Frames compressed once for many sessions
+        // cannot depend on earlier messages
+        pmd.server_no_context_takeover = opts.preframed;
+        ws_.set_option(pmd);
+
+        // The decorator sees the response after the stream
+        // has added its side of the extension negotiation
+        ws_.set_option(websocket::stream_base::decorator(
+            [this](websocket::response_type &res)
+            {
+                on_extensions(res[http::field::sec_websocket_extensions]);
+            }));
+    }
 }
 websocket_session::
     ~websocket_session()
 {
+    // End a streamed message cut short
+    if (stream_)
+        end_stream();
+
     // Remove this session from the list of active sessions
     state_->disconnect(connection_id);
+
+    // Leave the grown buffer to the next session
+    session_pool::local().give_back(
+        std::move(buffer_), state_->options().pool_memory);
 }
 
 void websocket_session::
@@ -32,17 +103,81 @@ void websocket_session::
     if (ec)
         return fail(ec, "accept");
 
-    connection_id = generate_random_string(16);
-    state_->connect(connection_id, this);
+    connection_id = state_->connect(this);
+    subject_limiter_ = state_->subject_limiter(subject_);
 
     // Read a message
+    do_read();
+}
+
+void websocket_session::
+    do_read()
+{
+    // The recipients of a streamed message write nothing
+    // else until its next piece, so it may not be late, and
+    // trickling it in may not hold them up forever either
+    auto const timeout = state_->options().stream_timeout;
+    auto expiry = stream_deadline_;
+    if (timeout != 0)
+        expiry = std::min(
+            expiry,
+            net::steady_timer::clock_type::now() +
+                std::chrono::milliseconds(timeout));
+    if (stream_ && expiry != net::steady_timer::time_point::max())
+    {
+        stream_timer_.expires_at(expiry);
+        stream_timer_.async_wait(
+            bind_memory(
+                *memory_,
+                [sp = shared_from_this()](error_code ec)
+                {
+                    if (!ec)
+                        sp->on_stream_timeout();
+                }));
+    }
+
+    // A relayed message took over the buffer,
+    // continue with a recycled one
+    if (buffer_.capacity() == 0)
+        buffer_ = session_pool::local().take_buffer();
+
+    // With streaming, read at most a piece at a time
+    auto const chunk = state_->options().stream_chunk;
+    if (chunk != 0)
+        return ws_.async_read_some(
+            buffer_,
+            chunk,
+            bind_memory(
+                *memory_,
+                [sp = shared_from_this()](
+                    error_code ec, std::size_t bytes)
+                {
+                    sp->on_read(ec, bytes);
+                }));
+
     ws_.async_read(
         buffer_,
-        [sp = shared_from_this()](
-            error_code ec, std::size_t bytes)
-        {
-            sp->on_read(ec, bytes);
-        });
+        bind_memory(
+            *memory_,
+            [sp = shared_from_this()](
+                error_code ec, std::size_t bytes)
+            {
+                sp->on_read(ec, bytes);
+            }));
+}
+
+void websocket_session::
+    on_extensions(beast::string_view value)
+{
+    for (auto const &ext : http::ext_list{value})
+    {
+        if (!beast::iequals(ext.first, "permessage-deflate"))
+            continue;
+        deflate_bits_ = 15;
+        for (auto const &param : ext.second)
+            if (beast::iequals(param.first, "server_max_window_bits"))
+                deflate_bits_ = std::atoi(std::string(param.second).c_str());
+    }
 }
 
 void websocket_session::
@@ -56,51 +191,677 @@ void websocket_session::
 void websocket_session::
     on_read(error_code ec, std::size_t)
 {
-    // Handle the error, if any
+    // Handle the error, if any. The timer would keep
+    // the session, and its streamed message, alive.
     if (ec)
+    {
+        stream_timer_.cancel();
         return fail(ec, "read");
+    }
+
+    // Nothing more is taken from a session being closed
+    if (closing_)
+        return;
+
+    // A message too large to hold is relayed piece by piece
+    auto const chunk = state_->options().stream_chunk;
+    if (chunk != 0 && !ws_.is_message_done())
+    {
+        if (!stream_ && buffer_.size() < chunk)
+            return do_read();
+        return on_fragment(false);
+    }
+    if (stream_)
+        return on_fragment(true);
+
+    // Enforce the inbound rate limits
+    auto const size = buffer_.size();
+    if (state_->options().rate_policy == rate_limit_policy::drop)
+    {
+        if (!admit(size))
+        {
+            ++state_->stats().rate_limited_dropped;
+            buffer_.consume(size);
+            return do_read();
+        }
+    }
+    else
+    {
+        // Hold the message without reading another one,
+        // so the client is pushed back on through TCP
+        auto const wait = delay(size);
+        if (wait > rate_limiter::clock::duration::zero())
+        {
+            ++state_->stats().rate_limited_delayed;
+            timer_.expires_after(wait);
+            return timer_.async_wait(
+                bind_memory(
+                    *memory_,
+                    [sp = shared_from_this()](error_code ec)
+                    {
+                        sp->on_delay(ec);
+                    }));
+        }
+    }
 
-    // Send to all connections
-    state_->broadcast(beast::buffers_to_string(buffer_.data()));
+    // Handle the message
+    on_message();
 
     // Clear the buffer
     buffer_.consume(buffer_.size());
 
     // Read another message
-    ws_.async_read(
-        buffer_,
-        [sp = shared_from_this()](
-            error_code ec, std::size_t bytes)
+    do_read();
+}
+
+void websocket_session::
+    on_delay(error_code ec)
+{
+    if (ec)
+        return fail(ec, "timer");
+
+    on_message();
+    buffer_.consume(buffer_.size());
+    do_read();
+}
+
+// Relay the piece of a large message in buffer_ to every
+// connection, without waiting for the rest of the message
+void websocket_session::
+    on_fragment(bool fin)
+{
+    // The piece is in time, stop the timer
+    stream_timer_.expires_at(net::steady_timer::time_point::max());
+
+    bool const first = !stream_;
+    if (first)
+    {
+        stream_ = std::make_shared<std::weak_ptr<websocket_session> const>(
+            weak_from_this());
+        stream_binary_ = ws_.got_binary();
+        auto const deadline = state_->options().stream_deadline;
+        stream_deadline_ = deadline == 0
+            ? net::steady_timer::time_point::max()
+            : net::steady_timer::clock_type::now() +
+                  std::chrono::milliseconds(deadline);
+    }
+
+    // The piece takes over the buffer, and gives
+    // it back to the pool once it is written
+    auto const size = buffer_.size();
+    auto const limit = state_->options().pool_memory;
+    auto const c = std::allocate_shared<chunk>(
+        session_allocator<chunk>(limit));
+    c->buffer = std::move(buffer_);
+    c->reader = weak_from_this();
+    c->recycle = limit;
+    inflight_ += size;
+
+    auto msg = make_message(
+        c->buffer.data(), c, std::string(), stream_binary_);
+    msg->set_fragment(stream_, first, fin);
+    if (fin)
+        stream_.reset();
+    state_->stream(std::move(msg));
+
+    // A piece can not be dropped, but the next
+    // one waits while over the rate limits
+    auto const wait = delay(size, first ? 1 : 0);
+    if (wait > rate_limiter::clock::duration::zero())
+    {
+        ++state_->stats().rate_limited_delayed;
+        timer_.expires_after(wait);
+        return timer_.async_wait(
+            bind_memory(
+                *memory_,
+                [sp = shared_from_this()](error_code ec)
+                {
+                    if (!ec)
+                        sp->resume();
+                }));
+    }
+    resume();
+}
+
+// The next piece of the streamed message did not arrive in time
+void websocket_session::
+    on_stream_timeout()
+{
+    // The timer may have been moved on by a piece which
+    // arrived as it expired, or the message may be over
+    if (!stream_ ||
+        stream_timer_.expiry() > net::steady_timer::clock_type::now())
+        return;
+    abort_stream(stream_.get());
+}
+
+// End the streamed message, if it is still being read, where it
+// stands and close the session, which is holding up the recipients
+void websocket_session::
+    abort_stream(void const *stream)
+{
+    if (!stream_ || stream_.get() != stream)
+        return;
+    ++state_->stats().streams_aborted;
+
+    // Let the recipients write something else,
+    // and close the session once its writes are done
+    end_stream();
+    closing_ = true;
+    if (writing_.empty())
+        do_close();
+}
+
+// End the streamed message being read with an empty last
+// piece, so that its recipients can write something else
+void websocket_session::
+    end_stream()
+{
+    auto msg = make_message(
+        std::string(), std::string(), stream_binary_);
+    msg->set_fragment(stream_, false, true);
+    stream_.reset();
+    state_->stream(std::move(msg));
+}
+
+// Read on, unless the recipients still hold too much of the
+// streamed messages of this session
+void websocket_session::
+    resume()
+{
+    auto const ceiling = state_->options().stream_memory;
+    if (ceiling != 0 && inflight_ >= ceiling)
+    {
+        // release() reads on once below the ceiling. Check
+        // again in case it ran before waiting_ was set.
+        waiting_ = true;
+        if (inflight_ >= ceiling || !waiting_.exchange(false))
+            return;
+    }
+    do_read();
+}
+
+// Called from any thread when a piece was written by every recipient
+void websocket_session::
+    release(std::size_t bytes)
+{
+    auto const ceiling = state_->options().stream_memory;
+    if ((inflight_ -= bytes) < ceiling && waiting_.exchange(false))
+        net::post(
+            ws_.get_executor(),
+            bind_memory(
+                *memory_,
+                [sp = shared_from_this()]
+                {
+                    sp->do_read();
+                }));
+}
+
+// Returns true if the message fits within the limits of
+// the session and of its subject, taking the tokens
+bool websocket_session::
+    admit(std::size_t bytes)
+{
+    if (limiter_ && !limiter_->try_acquire(bytes))
+        return false;
+    if (subject_limiter_ && !subject_limiter_->try_acquire(bytes))
+    {
+        if (limiter_)
+            limiter_->release(bytes);
+        return false;
+    }
+    return true;
+}
+
+// Take the tokens of a message, returning how long to wait
+// before the session and its subject are within their limits
+rate_limiter::clock::duration
+websocket_session::
+    delay(std::size_t bytes, std::size_t messages)
+{
+    auto wait = rate_limiter::clock::duration::zero();
+    if (limiter_)
+        wait = limiter_->acquire(bytes, messages);
+    if (subject_limiter_)
+        wait = std::max(wait, subject_limiter_->acquire(bytes, messages));
+    return wait;
+}
+
+// Dispatch the message in buffer_. A text message starting with
+// '{' is a JSON command envelope, see on_command. Recognized
+// text commands are
+//
+//     /subscribe <topic>
+//     /unsubscribe <topic>
+//     /publish <topic> <text>
+//     /replay <seq> [<topic>]
+//
+// anything else is relayed to all connections. A relayed or
+// published message takes over buffer_ instead of copying it.
+void websocket_session::
+    on_message()
+{
+    auto const binary = ws_.got_binary();
+    auto const data = buffer_.data();
+    beast::string_view const text(
+        static_cast<char const *>(data.data()), data.size());
+
+    auto const command = [&](beast::string_view name)
+    {
+        return !binary &&
+               text.size() > name.size() &&
+               text.substr(0, name.size()) == name &&
+               text[name.size()] == ' ';
+    };
+
+    if (!binary && !text.empty() && text.front() == '{')
+        return on_command(text);
+
+    if (command("/subscribe"))
+        return state_->subscribe(
+            connection_id, std::string(text.substr(11)));
+
+    if (command("/unsubscribe"))
+        return state_->unsubscribe(
+            connection_id, std::string(text.substr(13)));
+
+    if (command("/replay"))
+    {
+        auto const pos = text.find(' ', 8);
+        auto const seq = std::string(text.substr(8, pos - 8));
+        replay_seq_ = std::strtoull(seq.c_str(), nullptr, 10);
+        replay_topic_ = pos == beast::string_view::npos
+            ? std::string()
+            : std::string(text.substr(pos + 1));
+        replay_left_ = state_->options().replay_limit;
+        replaying_ = replay_left_ != 0;
+        if (replaying_)
+            replay_page();
+        return;
+    }
+
+    if (command("/publish"))
+    {
+        auto const pos = text.find(' ', 9);
+        if (pos != beast::string_view::npos)
         {
-            sp->on_read(ec, bytes);
-        });
+            std::string topic(text.substr(9, pos - 9));
+            buffer_.consume(pos + 1);
+            return state_->publish(
+                std::move(topic), std::move(buffer_), binary);
+        }
+    }
+
+    // Relay to all connections
+    state_->broadcast(std::move(buffer_), binary);
 }
 
+// Dispatch a JSON command envelope, one of
+//
+//     {"type":"publish","topic":<topic>,"data":<text>}
+//     {"type":"send","to":<connection id>,"data":<text>}
+//     {"type":"subscribe","topic":<topic>}
+//     {"type":"unsubscribe","topic":<topic>}
+//     {"type":"ping","id":<any>}
+//
+// "topic" may be left out of a publish to send to everyone, and
+// "id" is optional. A malformed command is answered with
+// {"type":"error","error":<reason>}.
 void websocket_session::
-    send(std::shared_ptr<std::string const> const &ss)
+    on_command(beast::string_view text)
 {
-    // Always add to queue
-    queue_.push_back(ss);
+    // Start over at the beginning of the session's buffer.
+    // Nothing may still point into the previous value.
+    resource_.release();
+    parser_.reset(&resource_);
+
+    error_code ec;
+    parser_.write(text.data(), text.size(), ec);
+    if (ec)
+        return reply(R"({"type":"error","error":"invalid json"})");
+    auto const jv = parser_.release();
+
+    auto const obj = jv.if_object();
+    if (!obj)
+        return reply(R"({"type":"error","error":"expected an object"})");
+
+    // Returns a string member, or null
+    auto const field = [obj](json::string_view name) -> json::string const *
+    {
+        auto const v = obj->if_contains(name);
+        return v ? v->if_string() : nullptr;
+    };
+    auto const to_string = [](json::string const &s)
+    {
+        return std::string(s.data(), s.size());
+    };
+
+    auto const type = field("type");
+    if (!type)
+        return reply(R"({"type":"error","error":"missing type"})");
+    json::string_view const name = *type;
+
+    if (name == "ping")
+    {
+        auto const id = obj->if_contains("id");
+        if (!id)
+            return reply(R"({"type":"pong"})");
+        return reply(R"({"type":"pong","id":)" + json::serialize(*id) + "}");
+    }
+
+    auto const data = field("data");
+    auto const topic = field("topic");
+
+    if (name == "publish" && data)
+    {
+        if (!topic || topic->size() == 0)
+            return state_->broadcast(to_string(*data));
+        return state_->publish(to_string(*topic), to_string(*data));
+    }
+
+    if (name == "send" && data)
+    {
+        auto const to = field("to");
+        if (to && state_->send(
+                      parse_connection_id(to_string(*to)),
+                      to_string(*data)))
+            return;
+        return reply(R"({"type":"error","error":"unknown recipient"})");
+    }
+
+    if (name == "subscribe" && topic)
+        return state_->subscribe(connection_id, to_string(*topic));
+
+    if (name == "unsubscribe" && topic)
+        return state_->unsubscribe(connection_id, to_string(*topic));
+
+    reply(R"({"type":"error","error":"bad command"})");
+}
+
+// Queue the next page of a replay and write it. Pages are no
+// larger than the queue limit, and each waits until the last
+// one was written, so a replay never trips the limits.
+void websocket_session::
+    replay_page()
+{
+    auto page = std::min(replay_page_size, replay_left_);
+    auto const limit = state_->options().queue_limit;
+    if (limit != 0)
+        page = std::min(page, limit);
+    auto const v = state_->replay(replay_seq_, replay_topic_, page);
+    for (auto const &msg : v)
+        enqueue(msg);
+    replay_left_ -= v.size();
+    if (replay_seq_ == 0 || replay_left_ == 0)
+        replaying_ = false;
+
+    if (!closing_ && writing_.empty() &&
+        (queued() > 0 || !fragments_.empty()))
+        return do_write();
+
+    // This part of the log had nothing for the topic,
+    // look further once other work had its turn
+    if (replaying_ && v.empty())
+        net::post(
+            ws_.get_executor(),
+            bind_memory(
+                *memory_,
+                [sp = shared_from_this()]
+                {
+                    if (sp->replaying_ && sp->writing_.empty())
+                        sp->replay_page();
+                }));
+}
+
+// Queue a message for this session only,
+// we are already running on its strand
+void websocket_session::
+    reply(std::string payload)
+{
+    auto msg = make_message(std::move(payload));
+    msg->set_priority(message_priority::high);
+    on_send(std::move(msg));
+}
+
+void websocket_session::
+    send(message_ptr const &msg)
+{
+    // Post our work to the strand, this ensures
+    // that the members of `this` will not be
+    // accessed concurrently.
+    net::post(
+        ws_.get_executor(),
+        bind_memory(
+            *memory_,
+            [sp = shared_from_this(), msg]()
+            {
+                sp->on_send(msg);
+            }));
+}
+
+void websocket_session::
+    send(std::shared_ptr<std::vector<message_ptr> const> const &batch)
+{
+    // One trip through the strand for the whole batch, and one
+    // gathered write for its messages whatever the coalesce option
+    net::post(
+        ws_.get_executor(),
+        bind_memory(
+            *memory_,
+            [sp = shared_from_this(), batch]()
+            {
+                for (auto const &msg : *batch)
+                    sp->enqueue(msg);
+                if (sp->closing_ || !sp->writing_.empty() || sp->queued() == 0)
+                    return;
+                if (sp->active_stream_ || sp->queued() == 1)
+                    return sp->do_write();
+                sp->do_write_gathered(std::min(
+                    sp->queued(),
+                    std::max(batch->size(), sp->state_->options().coalesce)));
+            }));
+}
+
+void websocket_session::
+    on_send(message_ptr const &msg)
+{
+    enqueue(msg);
 
     // Are we already writing?
-    if (queue_.size() > 1)
+    if (closing_ || !writing_.empty() ||
+        (queued() == 0 && fragments_.empty()))
         return;
 
     // We are not currently writing, so send this immediately
+    do_write();
+}
+
+void websocket_session::
+    enqueue(message_ptr const &msg)
+{
+    // Nothing more goes out to a consumer we are closing
+    auto &stats = state_->stats();
+    if (closing_)
+    {
+        ++stats.dropped_on_disconnect;
+        return;
+    }
+
+    // The pieces of a streamed message wait on their own, outside
+    // the limits, since dropping one would corrupt the message.
+    // Their memory is bounded by the session reading the message.
+    if (msg->fragment())
+    {
+        auto const it = std::find(
+            joined_.begin(), joined_.end(), msg->stream());
+        if (msg->first())
+            joined_.push_back(msg->stream());
+        else if (it == joined_.end())
+            return; // We connected after the message began
+        if (msg->fin())
+            joined_.erase(std::find(
+                joined_.begin(), joined_.end(), msg->stream()));
+        fragments_.push_back(msg);
+        return;
+    }
+
+    // Always add to the queue of the message's priority
+    auto &queue = queues_[static_cast<std::size_t>(msg->priority())];
+    queue.push_back(msg);
+    queue_bytes_ += msg->size();
+
+    // Enforce the limits, the messages being written must stay.
+    // A session waiting for the next piece of a streamed message
+    // is not to blame for what queues up behind it, the session
+    // streaming it is stopped instead. Meanwhile the queues may
+    // hold up to twice the limits.
+    if (queue_full() && blocked_on_stream())
+    {
+        stop_streamer();
+        if (!queue_full(2))
+            return;
+    }
+    if (queue_full())
+    {
+        switch (state_->options().slow_consumer)
+        {
+        case slow_consumer_policy::drop_oldest:
+            // Normal traffic is given up before high priority
+            while (queue_full() && queued() > 1)
+            {
+                auto &victim = queues_[1].empty() ? queues_[0] : queues_[1];
+                pop_front(victim);
+                ++stats.dropped_oldest;
+            }
+            break;
+
+        case slow_consumer_policy::drop_newest:
+            pop_back(queue);
+            ++stats.dropped_newest;
+            return;
+
+        case slow_consumer_policy::disconnect:
+            // Discard everything not yet being written. The
+            // close is sent once the current write completes,
+            // so it does not interleave with a raw frame.
+            closing_ = true;
+            ++stats.slow_consumer_disconnects;
+            for (auto &q : queues_)
+            {
+                while (!q.empty())
+                {
+                    pop_back(q);
+                    ++stats.dropped_on_disconnect;
+                }
+            }
+            while (!fragments_.empty())
+            {
+                fragments_.pop_back();
+                ++stats.dropped_on_disconnect;
+            }
+            if (writing_.empty())
+                do_close();
+            return;
+        }
+    }
+}
+
+void websocket_session::
+    do_write()
+{
+    // Other messages wait while a streamed message is being
+    // written, its frames can not be interleaved with theirs
+    if (active_stream_ || queued() == 0)
+        return do_write_fragment();
+
+    // When messages are backed up, send several at once
+    auto const coalesce = state_->options().coalesce;
+    if (coalesce > 1 && queued() > 1)
+        return do_write_gathered(std::min(coalesce, queued()));
+
+    take();
+    auto const &msg = *writing_.front();
+    if (msg.framed())
+    {
+        // The frame was serialized once for all the recipients,
+        // write its bytes straight to the socket. The queue
+        // guarantees no other message write is in progress, and
+        // the socket keeps them apart from the pongs and closes
+        // the stream sends on its own.
+        ws_.next_layer().async_write_raw(
+            msg.frame(deflate_bits_),
+            bind_memory(
+                *memory_,
+                [sp = shared_from_this()](
+                    error_code ec, std::size_t bytes)
+                {
+                    sp->on_write(ec, bytes);
+                }));
+        return;
+    }
+
+    ws_.binary(msg.binary());
     ws_.async_write(
-        net::buffer(*queue_.front()),
-        [sp = shared_from_this()](
-            error_code ec, std::size_t bytes)
+        msg.data(),
+        bind_memory(
+            *memory_,
+            [sp = shared_from_this()](
+                error_code ec, std::size_t bytes)
+            {
+                sp->on_write(ec, bytes);
+            }));
+}
+
+void websocket_session::
+    do_write_gathered(std::size_t n)
+{
+    // Frame every message ourselves, using the pre-built frame
+    // when there is one, and hand all of them to the socket in
+    // a single gathered write, kept apart from the frames the
+    // stream writes on its own. A batch may be larger than the
+    // coalesce option made room for.
+    if (headers_.size() < n)
+        headers_.resize(n);
+    buffers_.clear();
+    for (std::size_t i = 0; i < n; ++i)
+        take();
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        auto const &msg = *writing_[i];
+        if (msg.framed())
         {
-            sp->on_write(ec, bytes);
-        });
+            for (auto const &b : msg.frame(deflate_bits_))
+                if (b.size() > 0)
+                    buffers_.push_back(b);
+            continue;
+        }
+        auto const size = write_frame_header(
+            headers_[i].data(), msg.size(), msg.binary());
+        buffers_.push_back(net::buffer(headers_[i].data(), size));
+        for (auto const &b : msg.data())
+            if (b.size() > 0)
+                buffers_.push_back(b);
+    }
+
+    // The write refers to the buffers, copying the
+    // vector would allocate for every gathered write
+    ws_.next_layer().async_write_raw(
+        beast::span<net::const_buffer const>(buffers_.data(), buffers_.size()),
+        bind_memory(
+            *memory_,
+            [sp = shared_from_this()](
+                error_code ec, std::size_t bytes)
+            {
+                sp->on_write(ec, bytes);
+            }));
 }
+
 void websocket_session::
     on_write_401(error_code ec, std::size_t)
 {
     if (ec)
         return fail(ec, "write");
-    ws_.next_layer().shutdown(tcp::socket::shutdown_send, ec);
+    beast::get_lowest_layer(ws_).shutdown(tcp::socket::shutdown_send, ec);
 }
 void websocket_session::
     on_write(error_code ec, std::size_t)
@@ -109,37 +870,173 @@ void websocket_session::
     if (ec)
         return fail(ec, "write");
 
-    // Remove the string from the queue
-    queue_.erase(queue_.begin());
+    // Forget the written messages
+    for (auto const &msg : writing_)
+        if (!msg->fragment())
+            queue_bytes_ -= msg->size();
+    writing_.clear();
+
+    // Tell a slow consumer why it is being dropped
+    if (closing_)
+        return do_close();
+
+    // A replay goes on once its last page is written
+    if (replaying_ && queued() == 0)
+        return replay_page();
 
     // Send the next message if any
-    if (!queue_.empty())
-        ws_.async_write(
-            net::buffer(*queue_.front()),
+    if (queued() > 0 || !fragments_.empty())
+        do_write();
+}
+
+// Write the next piece of a streamed message as one frame,
+// with FIN set on the last piece
+void websocket_session::
+    do_write_fragment()
+{
+    // The next piece may not have arrived yet
+    if (!take_fragment())
+        return;
+
+    auto const &msg = *writing_.front();
+    if (msg.first())
+        ws_.binary(msg.binary());
+    ws_.async_write_some(
+        msg.fin(),
+        msg.payload(),
+        bind_memory(
+            *memory_,
             [sp = shared_from_this()](
                 error_code ec, std::size_t bytes)
             {
                 sp->on_write(ec, bytes);
-            });
+            }));
 }
 
-std::string
-websocket_session::generate_random_string(int length)
+void websocket_session::
+    do_close()
+{
+    ws_.async_close(
+        websocket::close_code::policy_error,
+        bind_memory(
+            *memory_,
+            std::bind(
+                &websocket_session::on_close,
+                shared_from_this(),
+                std::placeholders::_1)));
+}
+
+// With a limit on the number of messages, the normal priority
+// queue gets room for as many as the limits let through, which
+// is twice the limit while blocked on a stream, plus the one
+// being added. It only has to grow when there is no such limit.
+std::size_t
+websocket_session::
+    queue_capacity(server_options const &opts) noexcept
+{
+    if (opts.queue_limit == 0)
+        return 16;
+    return 2 * opts.queue_limit + 1;
+}
+
+bool websocket_session::
+    queue_full(std::size_t factor) const noexcept
 {
-    const char charset[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
-    const int charset_size = sizeof(charset) - 1;
-    std::mt19937_64 rng(std::time(nullptr));
-    std::uniform_int_distribution<int> distribution(0, charset_size - 1);
+    auto const &opts = state_->options();
+    return (opts.queue_limit != 0 &&
+            queued() + writing_.size() > factor * opts.queue_limit) ||
+           (opts.queue_limit_bytes != 0 &&
+            queue_bytes_ > factor * opts.queue_limit_bytes);
+}
+
+// Returns true if the next piece of the streamed message
+// being written has not arrived yet
+bool websocket_session::
+    blocked_on_stream() const noexcept
+{
+    if (!active_stream_)
+        return false;
+    for (std::size_t i = 0; i < fragments_.size(); ++i)
+        if (fragments_[i]->stream() == active_stream_)
+            return false;
+    return true;
+}
 
-    std::string random_string;
-    random_string.reserve(length);
+// Ask the session reading the streamed message being written to
+// end it, once. It runs on its own strand, perhaps on another
+// thread, so this rare request does not use its handler memory.
+void websocket_session::
+    stop_streamer()
+{
+    auto const sp = streamer_.lock();
+    streamer_.reset();
+    if (!sp)
+        return;
+    net::post(
+        sp->ws_.get_executor(),
+        [sp, stream = active_stream_]
+        {
+            sp->abort_stream(stream);
+        });
+}
+
+std::size_t
+websocket_session::
+    queued() const noexcept
+{
+    return queues_[0].size() + queues_[1].size();
+}
+
+// Move the next message to write from the front of
+// the highest priority queue which has one
+void websocket_session::
+    take()
+{
+    for (auto &q : queues_)
+    {
+        if (q.empty())
+            continue;
+        writing_.push_back(std::move(q.front()));
+        q.pop_front();
+        return;
+    }
+}
 
-    for (int i = 0; i < length; ++i)
+// Move the next piece of the message being written, or the
+// first piece of another one, returning false if there is none
+bool websocket_session::
+    take_fragment()
+{
+    for (std::size_t i = 0; i < fragments_.size(); ++i)
     {
-        random_string.push_back(charset[distribution(rng)]);
+        auto const &msg = *fragments_[i];
+        if (active_stream_
+                ? msg.stream() != active_stream_
+                : !msg.first())
+            continue;
+        if (msg.first())
+            streamer_ = *static_cast<
+                std::weak_ptr<websocket_session> const *>(msg.stream());
+        active_stream_ = msg.fin() ? nullptr : msg.stream();
+        writing_.push_back(std::move(fragments_[i]));
+        fragments_.erase(i);
+        return true;
     }
+    return false;
+}
 
-    return random_string;
+void websocket_session::
+    pop_front(ring_buffer<message_ptr> &q)
+{
+    queue_bytes_ -= q.front()->size();
+    q.pop_front();
+}
+
+void websocket_session::
+    pop_back(ring_buffer<message_ptr> &q)
+{
+    queue_bytes_ -= q.back()->size();
+    q.pop_back();
 }
 
 std::string
@@ -170,10 +1067,12 @@ void websocket_session::close_with_401(http::request<http::string_body> &req, co
 {
     // Close the WebSocket connection
     ws_.async_close(websocket::close_code::normal,
-        std::bind(
-            &websocket_session::on_close,
-            shared_from_this(),
-            std::placeholders::_1));
+        bind_memory(
+            *memory_,
+            std::bind(
+                &websocket_session::on_close,
+                shared_from_this(),
+                std::placeholders::_1)));
 
     // Send an HTTP response with a 401 status code and an error message
     http::response<http::string_body> res{http::status::unauthorized, req.version()};
@@ -186,9 +1085,11 @@ void websocket_session::close_with_401(http::request<http::string_body> &req, co
     auto sp = std::make_shared<response_type>(std::forward<decltype(res)>(res));
 
     http::async_write(ws_.next_layer() , *sp,
-        [self = shared_from_this(), sp](
-            error_code ec, std::size_t bytes)
-        {
-            self->on_write_401(ec, bytes);
-        });
+        bind_memory(
+            *memory_,
+            [self = shared_from_this(), sp](
+                error_code ec, std::size_t bytes)
+            {
+                self->on_write_401(ec, bytes);
+            }));
 }
\ No newline at end of file
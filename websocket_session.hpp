@@ -3,8 +3,18 @@
 
 #include "net.hpp"
 #include "beast.hpp"
+#include "gated_socket.hpp"
+#include "handler_memory.hpp"
+#include "json.hpp"
+#include "message.hpp"
+#include "rate_limiter.hpp"
+#include "ring_buffer.hpp"
+#include "session_pool.hpp"
 #include "shared_state.hpp"
 #include "include/jwt-cpp/traits/boost-json/defaults.h"
+#include <array>
+#include <atomic>
+#include <cstdint>
 #include <cstdlib>
 #include <memory>
 #include <string>
@@ -17,22 +27,125 @@ class shared_state;
  */
 class websocket_session : public std::enable_shared_from_this<websocket_session>
 {
+    // Recycled by every asynchronous operation of the session
+    handler_memory::pointer memory_ = handler_memory::create();
+
     beast::flat_buffer buffer_;
-    websocket::stream<tcp::socket> ws_;
+    websocket::stream<gated_socket> ws_;
     std::shared_ptr<shared_state> state_;
-    std::vector<std::shared_ptr<std::string const>> queue_;
-    std::string connection_id;
+    // Outgoing messages waiting to be written, one queue for
+    // each message_priority. A message is only written when the
+    // queues before its own are empty, so high priority traffic
+    // goes ahead of the backlog at the next frame boundary.
+    std::array<ring_buffer<message_ptr>, 2> queues_;
+
+    // Bytes waiting or being written
+    std::size_t queue_bytes_ = 0;
+
+    // The messages being written
+    std::vector<message_ptr> writing_;
+
+    // Pieces of streamed messages waiting to be written, which are
+    // not subject to the queue limits. Nothing else is written while
+    // a streamed message is partly written, and a session which
+    // missed the first piece of a message skips the whole message.
+    // While the session waits for the next piece, the queues may
+    // grow to twice their limits and the session reading the
+    // message is stopped when they are over.
+    ring_buffer<message_ptr> fragments_;
+    void const *active_stream_ = nullptr;
+    std::weak_ptr<websocket_session> streamer_;
+    std::vector<void const *> joined_;
+
+    // The message this session is reading piece by piece, which
+    // identifies it and refers back to this session, and the
+    // bytes of its pieces still held by recipients. Reading
+    // stops while they exceed the stream_memory option, and the
+    // timer ends the message if the next piece is late or the
+    // whole message is past its deadline.
+    struct chunk;
+    std::shared_ptr<std::weak_ptr<websocket_session> const> stream_;
+    net::steady_timer stream_timer_;
+    net::steady_timer::time_point stream_deadline_;
+    bool stream_binary_ = false;
+    std::atomic<std::size_t> inflight_{0};
+    std::atomic<bool> waiting_{false};
+
+    // Scratch space for gathered writes of several frames
+    std::vector<std::array<unsigned char, 10>> headers_;
+    std::vector<net::const_buffer> buffers_;
+    std::uint64_t connection_id = 0;
+
+    // Set once the session gave up on a slow consumer
+    bool closing_ = false;
+
+    // A /replay sent a page at a time: where the next page starts,
+    // the topic, and how many more messages it may resend
+    static constexpr std::size_t replay_page_size = 64;
+    std::uint64_t replay_seq_ = 0;
+    std::string replay_topic_;
+    std::size_t replay_left_ = 0;
+    bool replaying_ = false;
+
+    // Inbound limits for this session and for its JWT subject,
+    // and the timer used to hold a message over the limit
+    std::unique_ptr<rate_limiter> limiter_;
+    std::shared_ptr<rate_limiter> subject_limiter_;
+    std::string subject_;
+    net::steady_timer timer_;
+
+    // Command envelopes are parsed into memory owned by the
+    // session and reused for every message, so dispatching
+    // a command does not allocate
+    std::array<unsigned char, 4096> value_buffer_;
+    std::array<unsigned char, 1024> parse_buffer_;
+    json::monotonic_resource resource_;
+    json::parser parser_;
+
+    // Server window size of the negotiated permessage-deflate
+    // extension, or zero if the client did not negotiate it
+    int deflate_bits_ = 0;
 
     void fail(error_code ec, char const *what);
     void on_accept(error_code ec);
+    void do_read();
     void on_read(error_code ec, std::size_t bytes_transferred);
+    bool admit(std::size_t bytes);
+    rate_limiter::clock::duration delay(std::size_t bytes, std::size_t messages = 1);
+    void on_delay(error_code ec);
+    void on_fragment(bool fin);
+    void on_stream_timeout();
+    void abort_stream(void const *stream);
+    void end_stream();
+    void resume();
+    void release(std::size_t bytes);
+    void on_message();
+    void on_command(beast::string_view text);
+    void replay_page();
+    void reply(std::string payload);
+    void on_send(message_ptr const &msg);
+    void enqueue(message_ptr const &msg);
+    static std::size_t queue_capacity(server_options const &opts) noexcept;
+    bool queue_full(std::size_t factor = 1) const noexcept;
+    bool blocked_on_stream() const noexcept;
+    void stop_streamer();
+    std::size_t queued() const noexcept;
+    void take();
+    bool take_fragment();
+    void pop_front(ring_buffer<message_ptr> &q);
+    void pop_back(ring_buffer<message_ptr> &q);
+    void do_write();
+    void do_write_gathered(std::size_t n);
+    void do_write_fragment();
     void on_write(error_code ec, std::size_t bytes_transferred);
+    void do_close();
     void on_write_401(error_code ec, std::size_t bytes_transferred);
     void on_close(beast::error_code ec);
+    void on_extensions(beast::string_view value);
 
 public:
     websocket_session(
-        tcp::socket socket,
+        session_socket socket,
         std::shared_ptr<shared_state> const &state);
 
     ~websocket_session();
@@ -41,14 +154,15 @@ public:
     void
     run(http::request<Body, http::basic_fields<Allocator>> req);
 
-    // Send a message
+    // Send a message, may be called from any thread
     void
-    send(std::shared_ptr<std::string const> const &ss);
+    send(message_ptr const &msg);
 
-private:
-    std::string
-    generate_random_string(int length);
+    // Send several messages at once, may be called from any thread
+    void
+    send(std::shared_ptr<std::vector<message_ptr> const> const &batch);
 
+private:
     std::string
     url_decode(const std::string &input);
 
@@ -72,13 +186,17 @@ void websocket_session::
         const auto decoded_token = jwt::decode<jwt::traits::boost_json>(token);
         const auto verify = jwt::verify<jwt::traits::boost_json>().allow_algorithm(jwt::algorithm::hs256{"secret"}).with_issuer("auth0").with_audience("aud0");
         verify.verify(decoded_token);
+        if (decoded_token.has_subject())
+            subject_ = decoded_token.get_subject();
         std::cout << "succeed!" << '\n';
         ws_.async_accept(
             req,
-            std::bind(
-                &websocket_session::on_accept,
-                shared_from_this(),
-                std::placeholders::_1));
+            bind_memory(
+                *memory_,
+                std::bind(
+                    &websocket_session::on_accept,
+                    shared_from_this(),
+                    std::placeholders::_1)));
     }
     catch (const std::exception &e)
     {